@@ -1,5 +1,7 @@
 [BITS 16]
 [ORG 0x7C00]
+xor ax, ax
+mov ds, ax ; boot_drive and the DAP below are addressed from segment 0
 mov [boot_drive], dl
 ; V
 mov ah, 0x0E ; moves the function call to print a letter to high bits of AX
@@ -26,14 +28,17 @@ int 0x10
 mov ax, 0x0000
 mov es, ax ; now es = 0, cant set it directly
 
-mov ah, 0x02
-mov al, 0x80 ; read 128 sectors (64KB)
-mov ch, 0x00
-mov cl, 0x02
-mov dh, 0x00
+; load the kernel with INT 13h extensions: 4 reads of 64 sectors (32KB each),
+; 128KB in total, to 0x7E00 (the next sector after boot loader)
+load_kernel:
+mov ah, 0x42
 mov dl, [boot_drive] ; use the bios passed boot drive
-mov bx, 0x7E00 ; next sector after boot loader
-int 0x13 ; load kernel
+mov si, dap
+int 0x13
+add word [dap_segment], 0x800 ; next 32KB
+add dword [dap_lba], 64
+dec byte [load_chunks]
+jnz load_kernel
 ; --- Clear page tables ---
 mov edi, 0x1000
 mov ecx, 0x0C00
@@ -105,6 +110,18 @@ gdt_descriptor:
     dd gdt_start
 boot_drive: db 0
 
+; disk address packet for INT 13h AH=42h
+dap:
+    db 0x10         ; packet size
+    db 0
+    dw 64           ; sectors per read
+    dw 0x0000       ; destination offset
+dap_segment:
+    dw 0x07E0       ; destination segment (0x07E0:0000 = 0x7E00)
+dap_lba:
+    dq 1            ; first kernel sector
+load_chunks: db 4
+
 
 times 510 - ($ - $$) db 0 ; $ - $$ current address minus start address of the section - times that until 510 to pad the bootloader -> db 0 means fill up with empty memory
 dw 0xAA55 ; write the 2 byte signature so 0x55 comes first in memory
\ No newline at end of file
@@ -18,9 +18,18 @@ CFLAGS="-ffreestanding -mno-red-zone -fno-pic -mcmodel=large -I kernel -I kernel
 x86_64-elf-gcc $CFLAGS -c kernel/kernel.c -o kernel.o
 x86_64-elf-gcc $CFLAGS -c kernel/idt.c -o idt.o
 x86_64-elf-gcc $CFLAGS -c kernel/isr.c -o isr.o
+x86_64-elf-gcc $CFLAGS -c kernel/paging.c -o paging.o
+x86_64-elf-gcc $CFLAGS -c kernel/heap.c -o heap.o
+x86_64-elf-gcc $CFLAGS -c kernel/drivers/pci.c -o pci.o
+x86_64-elf-gcc $CFLAGS -c kernel/drivers/blockdev.c -o blockdev.o
 x86_64-elf-gcc $CFLAGS -c kernel/drivers/ata.c -o ata.o
+x86_64-elf-gcc $CFLAGS -c kernel/drivers/ahci.c -o ahci.o
+x86_64-elf-gcc $CFLAGS -c kernel/drivers/virtio_blk.c -o virtio_blk.o
+x86_64-elf-gcc $CFLAGS -c kernel/drivers/nvme.c -o nvme.o
 x86_64-elf-gcc $CFLAGS -c kernel/drivers/keyboard.c -o keyboard.o
+x86_64-elf-gcc $CFLAGS -c kernel/drivers/timer.c -o timer.o
 x86_64-elf-gcc $CFLAGS -c kernel/fs/vfs.c -o vfs.o
+x86_64-elf-gcc $CFLAGS -c kernel/fs/bcache.c -o bcache.o
 x86_64-elf-gcc $CFLAGS -c kernel/fs/fat32.c -o fat32.o
 x86_64-elf-gcc $CFLAGS -c kernel/elf_loader.c -o elf_loader.o
 
@@ -37,13 +46,20 @@ cd ..
 # Link kernel with mt-shell
 echo "[6/8] Linking kernel..."
 x86_64-elf-ld -T kernel/linker.ld -o kernel.bin \
-    entry.o isr_asm.o kernel.o idt.o isr.o ata.o keyboard.o vfs.o fat32.o \
+    entry.o isr_asm.o kernel.o idt.o isr.o paging.o heap.o pci.o blockdev.o ata.o ahci.o virtio_blk.o nvme.o keyboard.o timer.o vfs.o bcache.o fat32.o \
     elf_loader.o \
     mt-shell/lib.o mt-shell/shell.o
 
 # Create boot disk image
 echo "[7/8] Creating boot image..."
+# The bootloader loads 256 sectors (128KB) after the boot sector
+KERNEL_SIZE=$(stat -c %s kernel.bin)
+if [ "$KERNEL_SIZE" -gt 131072 ]; then
+    echo "kernel.bin is $KERNEL_SIZE bytes; the bootloader only loads 131072"
+    exit 1
+fi
 cat boot.bin kernel.bin > vanta.img
+truncate -s $((512 * 257)) vanta.img
 
 # Create FAT32 filesystem from testfs/
 echo "[8/8] Building testfs..."
@@ -56,9 +72,10 @@ mcopy -i testfs.img -s testfs/* ::/ 2>/dev/null || true
 
 echo "=== Build complete! Starting QEMU... ==="
 
-# Run with both disks
+# Run with the boot disk on the primary IDE channel and the data disk on
+# the secondary, so the two channels can work in parallel
 qemu-system-x86_64 \
     -drive file=vanta.img,format=raw,index=0 \
-    -drive file=testfs.img,format=raw,index=1
+    -drive file=testfs.img,format=raw,index=2
 
 echo "Done"
@@ -0,0 +1,376 @@
+#include "ahci.h"
+#include "pci.h"
+#include "../heap.h"
+#include "../idt.h"
+#include "../isr.h"
+
+// Disable interrupts, returning the previous flags
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    __asm__ volatile ("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+// Per-disk state. Up to max_slots commands are in flight at once; requests
+// that do not fit wait in a FIFO. The head of that FIFO may be partially
+// issued when it is larger than one command.
+struct ahci_port {
+    volatile struct hba_port *regs;
+    struct ahci_cmd_header *cmd_list;
+    struct ahci_cmd_table *cmd_tables;
+    uint8_t *fis;
+
+    int ncq;                  // Use READ/WRITE FPDMA QUEUED
+    int exclusive;            // In-flight command must run alone (cache flush)
+    uint32_t max_slots;       // Commands kept in flight
+    uint32_t busy;            // Slots in use
+    struct blk_request *slot_req[AHCI_MAX_SLOTS];
+
+    struct blk_request *queue_head;
+    struct blk_request *queue_tail;
+    uint64_t head_lba;        // Next sector of the queue head to issue
+    uint32_t head_left;       // Sectors of the queue head not yet issued
+    uint8_t *head_pos;
+
+    struct blockdev blockdev;
+};
+
+static volatile struct hba_mem *hba = 0;
+static struct ahci_port ports[AHCI_MAX_DISKS];
+static int port_count = 0;
+
+static void ahci_stop_port(volatile struct hba_port *regs) {
+    regs->cmd &= ~(HBA_PxCMD_ST | HBA_PxCMD_FRE);
+    while (regs->cmd & (HBA_PxCMD_FR | HBA_PxCMD_CR));
+}
+
+static void ahci_start_port(volatile struct hba_port *regs) {
+    while (regs->cmd & HBA_PxCMD_CR);
+    regs->cmd |= HBA_PxCMD_FRE;
+    regs->cmd |= HBA_PxCMD_ST;
+}
+
+// Fill a command slot's header, FIS and PRD table for a buffer
+static int ahci_build_command(struct ahci_port *p, int slot, uint8_t command, uint64_t lba,
+                              uint32_t count, void *buffer, uint32_t bytes, int write) {
+    struct ahci_cmd_header *hdr = &p->cmd_list[slot];
+    struct ahci_cmd_table *tbl = &p->cmd_tables[slot];
+    uint64_t addr = (uint64_t)(uintptr_t)buffer;
+
+    if (addr & 1) return -1;  // HBA needs word-aligned data
+
+    int n = 0;
+    while (bytes > 0) {
+        if (n == AHCI_PRDT_MAX) return -1;
+        uint32_t chunk = bytes > AHCI_PRD_MAX_BYTES ? AHCI_PRD_MAX_BYTES : bytes;
+        tbl->prdt[n].dba = (uint32_t)addr;
+        tbl->prdt[n].dbau = (uint32_t)(addr >> 32);
+        tbl->prdt[n].reserved = 0;
+        tbl->prdt[n].dbc = chunk - 1;
+        addr += chunk;
+        bytes -= chunk;
+        n++;
+    }
+
+    struct fis_reg_h2d *fis = (struct fis_reg_h2d *)tbl->cfis;
+    uint8_t *raw = tbl->cfis;
+    for (uint32_t i = 0; i < sizeof(struct fis_reg_h2d); i++) raw[i] = 0;
+
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->pmport_c = 0x80;
+    fis->command = command;
+    fis->device = 0x40;  // LBA mode
+    fis->lba0 = lba & 0xFF;
+    fis->lba1 = (lba >> 8) & 0xFF;
+    fis->lba2 = (lba >> 16) & 0xFF;
+    fis->lba3 = (lba >> 24) & 0xFF;
+    fis->lba4 = (lba >> 32) & 0xFF;
+    fis->lba5 = (lba >> 40) & 0xFF;
+
+    if (command == AHCI_CMD_READ_FPDMA || command == AHCI_CMD_WRITE_FPDMA) {
+        // NCQ: count goes in the feature registers, the tag in count
+        fis->featurel = count & 0xFF;
+        fis->featureh = (count >> 8) & 0xFF;
+        fis->countl = slot << 3;
+    } else {
+        fis->countl = count & 0xFF;
+        fis->counth = (count >> 8) & 0xFF;
+    }
+
+    hdr->flags = (sizeof(struct fis_reg_h2d) / 4) | (write ? AHCI_CMD_WRITE : 0);
+    hdr->prdtl = n;
+    hdr->prdbc = 0;
+    hdr->ctba = (uint32_t)(uintptr_t)tbl;
+    hdr->ctbau = (uint32_t)((uint64_t)(uintptr_t)tbl >> 32);
+    return 0;
+}
+
+// Run one command on slot 0 and poll for completion (used before the port
+// is handed to the request queue). Returns 0 on success.
+static int ahci_exec_polled(struct ahci_port *p, uint8_t command, void *buffer, uint32_t bytes) {
+    if (ahci_build_command(p, 0, command, 0, 0, buffer, bytes, 0) != 0) return -1;
+
+    while (p->regs->tfd & (HBA_PxTFD_BSY | HBA_PxTFD_DRQ));
+    p->regs->is = 0xFFFFFFFF;
+    p->regs->ci = 1;
+
+    while (p->regs->ci & 1) {
+        if (p->regs->is & HBA_PxIS_TFES) return -1;
+    }
+    return (p->regs->tfd & HBA_PxTFD_ERR) ? -1 : 0;
+}
+
+static void ahci_complete(struct blk_request *req) {
+    req->done = 1;
+    if (req->callback) {
+        req->callback(req);
+    }
+}
+
+// Hand out free slots to queued requests, one command per slot
+static void ahci_issue(struct ahci_port *p) {
+    while (p->queue_head) {
+        uint32_t in_flight = 0;
+        int slot = -1;
+        for (uint32_t i = 0; i < p->max_slots; i++) {
+            if (p->busy & (1u << i)) {
+                in_flight++;
+            } else if (slot < 0) {
+                slot = i;
+            }
+        }
+        if (slot < 0 || in_flight >= p->max_slots) return;
+
+        // Without NCQ the drive runs one command at a time, and a cache
+        // flush is never queued alongside others
+        struct blk_request *req = p->queue_head;
+        int queued = p->ncq && !req->flush;
+        if ((!queued || p->exclusive) && in_flight > 0) return;
+
+        uint32_t n = p->head_left > AHCI_CMD_MAX_SECTORS ? AHCI_CMD_MAX_SECTORS : p->head_left;
+        uint8_t command;
+        if (req->flush) {
+            command = AHCI_CMD_FLUSH_CACHE_EXT;
+        } else if (p->ncq) {
+            command = req->write ? AHCI_CMD_WRITE_FPDMA : AHCI_CMD_READ_FPDMA;
+        } else {
+            command = req->write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
+        }
+
+        if (ahci_build_command(p, slot, command, p->head_lba, n, p->head_pos, n * 512, req->write) != 0) {
+            req->status = -1;
+            n = p->head_left;  // Skip the rest of this request
+        } else {
+            p->busy |= 1u << slot;
+            p->slot_req[slot] = req;
+            p->exclusive = !queued;
+            req->pending++;
+            if (queued) p->regs->sact = 1u << slot;
+            p->regs->ci = 1u << slot;
+        }
+
+        p->head_lba += n;
+        p->head_pos += n * 512;
+        p->head_left -= n;
+
+        if (p->head_left == 0) {
+            // Fully issued; move on to the next request
+            p->queue_head = req->next;
+            if (!p->queue_head) p->queue_tail = 0;
+            req->next = 0;
+            if (req->pending == 0) ahci_complete(req);
+
+            if (p->queue_head) {
+                p->head_lba = p->queue_head->lba;
+                p->head_left = p->queue_head->count;
+                p->head_pos = (uint8_t *)p->queue_head->buffer;
+            }
+        }
+    }
+}
+
+// Finish a slot's command; completes its request once nothing is left
+static void ahci_finish_slot(struct ahci_port *p, int slot, int status) {
+    struct blk_request *req = p->slot_req[slot];
+    p->busy &= ~(1u << slot);
+    p->slot_req[slot] = 0;
+    if (!p->busy) p->exclusive = 0;
+    if (!req) return;
+
+    if (status != 0) req->status = -1;
+    req->pending--;
+    if (req->pending == 0 && req != p->queue_head) {
+        ahci_complete(req);
+    }
+}
+
+// Reap completed commands and refill the slots
+static void ahci_port_service(struct ahci_port *p) {
+    uint32_t is = p->regs->is;
+    p->regs->is = is;
+
+    if (is & HBA_PxIS_ERRORS) {
+        // Fail everything in flight and restart the command engine
+        ahci_stop_port(p->regs);
+        p->regs->serr = 0xFFFFFFFF;
+        p->regs->is = 0xFFFFFFFF;
+        for (int i = 0; i < AHCI_MAX_SLOTS; i++) {
+            if (p->busy & (1u << i)) ahci_finish_slot(p, i, -1);
+        }
+        ahci_start_port(p->regs);
+    } else {
+        uint32_t active = p->regs->ci | (p->ncq ? p->regs->sact : 0);
+        uint32_t finished = p->busy & ~active;
+        for (int i = 0; i < AHCI_MAX_SLOTS; i++) {
+            if (finished & (1u << i)) ahci_finish_slot(p, i, 0);
+        }
+    }
+
+    ahci_issue(p);
+}
+
+static void ahci_irq(int irq) {
+    (void)irq;
+    uint32_t pending = hba->is;
+    if (!pending) return;  // Shared line, not ours
+
+    for (int i = 0; i < port_count; i++) {
+        ahci_port_service(&ports[i]);
+    }
+    hba->is = pending;
+}
+
+static void ahci_poll(struct blockdev *dev) {
+    uint64_t flags = irq_save();
+    ahci_port_service((struct ahci_port *)dev->private_data);
+    irq_restore(flags);
+}
+
+static int ahci_submit(struct blockdev *dev, struct blk_request *req) {
+    struct ahci_port *p = (struct ahci_port *)dev->private_data;
+
+    uint64_t flags = irq_save();
+    if (p->queue_tail) {
+        p->queue_tail->next = req;
+    } else {
+        p->queue_head = req;
+        p->head_lba = req->lba;
+        p->head_left = req->count;
+        p->head_pos = (uint8_t *)req->buffer;
+    }
+    p->queue_tail = req;
+    ahci_issue(p);
+    irq_restore(flags);
+
+    return 0;
+}
+
+// Allocate the command list, FIS area and tables, then bring the port up
+static int ahci_port_init(struct ahci_port *p, volatile struct hba_port *regs) {
+    p->regs = regs;
+    p->cmd_list = kmalloc_aligned(sizeof(struct ahci_cmd_header) * AHCI_MAX_SLOTS, 1024);
+    p->fis = kmalloc_aligned(256, 256);
+    p->cmd_tables = kmalloc_aligned(sizeof(struct ahci_cmd_table) * AHCI_MAX_SLOTS, 128);
+    if (!p->cmd_list || !p->fis || !p->cmd_tables) return -1;
+
+    ahci_stop_port(regs);
+    regs->clb = (uint32_t)(uintptr_t)p->cmd_list;
+    regs->clbu = (uint32_t)((uint64_t)(uintptr_t)p->cmd_list >> 32);
+    regs->fb = (uint32_t)(uintptr_t)p->fis;
+    regs->fbu = (uint32_t)((uint64_t)(uintptr_t)p->fis >> 32);
+    regs->serr = 0xFFFFFFFF;
+    regs->is = 0xFFFFFFFF;
+    ahci_start_port(regs);
+    return 0;
+}
+
+// IDENTIFY the disk and size its queue
+static int ahci_identify(struct ahci_port *p, uint32_t hba_slots) {
+    uint16_t *ident = kmalloc_aligned(512, 2);
+    if (!ident || ahci_exec_polled(p, AHCI_CMD_IDENTIFY, ident, 512) != 0) return -1;
+
+    struct blockdev *dev = &p->blockdev;
+    dev->sector_size = 512;
+    dev->capacity = (uint64_t)ident[100] | ((uint64_t)ident[101] << 16) |
+                    ((uint64_t)ident[102] << 32) | ((uint64_t)ident[103] << 48);
+    if (dev->capacity == 0) {
+        dev->capacity = (uint32_t)ident[60] | ((uint32_t)ident[61] << 16);
+    }
+
+    // NCQ needs support from both the HBA and the drive (word 76 bit 8)
+    p->ncq = (hba->cap & HBA_CAP_SNCQ) && (ident[76] & (1 << 8));
+    if (p->ncq) {
+        uint32_t depth = (ident[75] & 0x1F) + 1;
+        if (depth > hba_slots) depth = hba_slots;
+        if (depth > AHCI_MAX_QUEUE_DEPTH) depth = AHCI_MAX_QUEUE_DEPTH;
+        p->max_slots = depth;
+    } else {
+        p->max_slots = 1;
+    }
+    return 0;
+}
+
+int ahci_init(void) {
+    struct pci_device pdev;
+    int found = 0;
+
+    for (int i = 0; pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, i, &pdev) == 0; i++) {
+        if (pdev.prog_if == AHCI_PROG_IF) {
+            found = 1;
+            break;
+        }
+    }
+    if (!found) return 0;
+
+    pci_enable(&pdev, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+    hba = (volatile struct hba_mem *)(uintptr_t)(pdev.bar[5] & 0xFFFFFFF0);
+    hba->ghc |= HBA_GHC_AE;
+
+    uint32_t hba_slots = ((hba->cap >> 8) & 0x1F) + 1;
+    uint32_t implemented = hba->pi;
+
+    for (int i = 0; i < 32 && port_count < AHCI_MAX_DISKS; i++) {
+        if (!(implemented & (1u << i))) continue;
+
+        volatile struct hba_port *regs = &hba->ports[i];
+        uint32_t ssts = regs->ssts;
+        if ((ssts & 0x0F) != HBA_PORT_DET_PRESENT) continue;
+        if (((ssts >> 8) & 0x0F) != HBA_PORT_IPM_ACTIVE) continue;
+        if (regs->sig != SATA_SIG_ATA) continue;
+
+        struct ahci_port *p = &ports[port_count];
+        if (ahci_port_init(p, regs) != 0) break;
+        if (ahci_identify(p, hba_slots) != 0) continue;
+
+        struct blockdev *dev = &p->blockdev;
+        dev->name[0] = 's';
+        dev->name[1] = 'd';
+        dev->name[2] = 'a' + port_count;
+        dev->name[3] = 0;
+        dev->submit = ahci_submit;
+        dev->private_data = p;
+
+        regs->is = 0xFFFFFFFF;
+        regs->ie = HBA_PxIS_DHRS | HBA_PxIS_SDBS | HBA_PxIS_DPS | HBA_PxIS_ERRORS;
+        port_count++;
+    }
+
+    // Use the legacy interrupt line if the firmware routed one, else poll
+    int irq = pdev.irq_line;
+    int use_irq = irq > 0 && irq < 16 && irq_install_handler(irq, ahci_irq) == 0;
+    for (int i = 0; i < port_count; i++) {
+        ports[i].blockdev.poll = use_irq ? 0 : ahci_poll;
+        blockdev_register(&ports[i].blockdev);
+    }
+    if (use_irq) {
+        hba->is = 0xFFFFFFFF;
+        hba->ghc |= HBA_GHC_IE;
+        pic_unmask(irq);
+    }
+
+    return port_count;
+}
@@ -0,0 +1,159 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+// PCI identification (mass storage / SATA / AHCI 1.0)
+#define PCI_SUBCLASS_SATA 0x06
+#define AHCI_PROG_IF      0x01
+
+// Limits
+#define AHCI_MAX_DISKS       4     // Disks registered as block devices
+#define AHCI_MAX_SLOTS       32    // Command slots per port (HBA maximum)
+#define AHCI_MAX_QUEUE_DEPTH 32    // NCQ commands kept in flight per port
+#define AHCI_PRDT_MAX        8     // PRD entries per command table
+#define AHCI_PRD_MAX_BYTES   0x400000  // 4 MB per PRD entry
+#define AHCI_CMD_MAX_SECTORS 65536 // Sectors per command
+
+// Port signature of an ATA disk
+#define SATA_SIG_ATA 0x00000101
+
+// SStatus fields
+#define HBA_PORT_DET_PRESENT 0x3
+#define HBA_PORT_IPM_ACTIVE  0x1
+
+// GHC bits
+#define HBA_GHC_IE 0x00000002  // Interrupt enable
+#define HBA_GHC_AE 0x80000000  // AHCI enable
+
+// CAP bits
+#define HBA_CAP_SNCQ 0x40000000  // Native command queuing
+
+// PxCMD bits
+#define HBA_PxCMD_ST  0x0001
+#define HBA_PxCMD_FRE 0x0010
+#define HBA_PxCMD_FR  0x4000
+#define HBA_PxCMD_CR  0x8000
+
+// PxIS / PxIE bits
+#define HBA_PxIS_DHRS 0x00000001  // D2H register FIS
+#define HBA_PxIS_PSS  0x00000002  // PIO setup FIS
+#define HBA_PxIS_DSS  0x00000004  // DMA setup FIS
+#define HBA_PxIS_SDBS 0x00000008  // Set device bits FIS (NCQ completion)
+#define HBA_PxIS_DPS  0x00000020  // Descriptor processed
+#define HBA_PxIS_IFS  0x08000000  // Interface fatal error
+#define HBA_PxIS_HBDS 0x10000000  // Host bus data error
+#define HBA_PxIS_HBFS 0x20000000  // Host bus fatal error
+#define HBA_PxIS_TFES 0x40000000  // Task file error
+#define HBA_PxIS_ERRORS (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
+// PxTFD bits
+#define HBA_PxTFD_ERR 0x01
+#define HBA_PxTFD_DRQ 0x08
+#define HBA_PxTFD_BSY 0x80
+
+// FIS types
+#define FIS_TYPE_REG_H2D 0x27
+
+// ATA commands used over AHCI
+#define AHCI_CMD_READ_DMA_EXT   0x25
+#define AHCI_CMD_WRITE_DMA_EXT  0x35
+#define AHCI_CMD_READ_FPDMA     0x60  // READ FPDMA QUEUED (NCQ)
+#define AHCI_CMD_WRITE_FPDMA    0x61  // WRITE FPDMA QUEUED (NCQ)
+#define AHCI_CMD_FLUSH_CACHE_EXT 0xEA
+#define AHCI_CMD_IDENTIFY       0xEC
+
+// Host to device register FIS
+struct fis_reg_h2d {
+    uint8_t fis_type;
+    uint8_t pmport_c;     // Bit 7: this FIS carries a command
+    uint8_t command;
+    uint8_t featurel;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t featureh;
+    uint8_t countl;
+    uint8_t counth;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+} __attribute__((packed));
+
+// Port registers
+struct hba_port {
+    uint32_t clb;         // Command list base
+    uint32_t clbu;
+    uint32_t fb;          // FIS receive base
+    uint32_t fbu;
+    uint32_t is;          // Interrupt status
+    uint32_t ie;          // Interrupt enable
+    uint32_t cmd;         // Command and status
+    uint32_t reserved0;
+    uint32_t tfd;         // Task file data
+    uint32_t sig;         // Signature
+    uint32_t ssts;        // SATA status
+    uint32_t sctl;        // SATA control
+    uint32_t serr;        // SATA error
+    uint32_t sact;        // SATA active (NCQ tags outstanding)
+    uint32_t ci;          // Command issue
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t reserved1[11];
+    uint32_t vendor[4];
+} __attribute__((packed));
+
+// HBA registers (ABAR)
+struct hba_mem {
+    uint32_t cap;
+    uint32_t ghc;
+    uint32_t is;
+    uint32_t pi;          // Ports implemented
+    uint32_t vs;
+    uint32_t ccc_ctl;
+    uint32_t ccc_pts;
+    uint32_t em_loc;
+    uint32_t em_ctl;
+    uint32_t cap2;
+    uint32_t bohc;
+    uint8_t  reserved[0xA0 - 0x2C];
+    uint8_t  vendor[0x100 - 0xA0];
+    struct hba_port ports[32];
+} __attribute__((packed));
+
+// Command list entry
+struct ahci_cmd_header {
+    uint16_t flags;       // Bits 4:0 FIS length in dwords, bit 6 write
+    uint16_t prdtl;       // PRD entries
+    volatile uint32_t prdbc;  // Bytes transferred
+    uint32_t ctba;        // Command table base
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__((packed));
+
+#define AHCI_CMD_WRITE 0x0040
+
+struct ahci_prdt_entry {
+    uint32_t dba;         // Data base address (word aligned)
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;         // Bits 21:0 byte count - 1, bit 31 interrupt on completion
+} __attribute__((packed));
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prdt_entry prdt[AHCI_PRDT_MAX];
+} __attribute__((packed));
+
+// Find the first AHCI controller and register its SATA disks (sda, sdb, ...)
+// as block devices. Returns the number of disks found.
+int ahci_init(void);
+
+#endif
@@ -1,4 +1,7 @@
 #include "ata.h"
+#include "pci.h"
+#include "../idt.h"
+#include "../isr.h"
 
 static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
@@ -10,6 +13,10 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port) : "memory");
+}
+
 static inline void inw_rep(uint16_t port, void *addr, uint32_t count) {
     __asm__ volatile ("rep insw" : "+D"(addr), "+c"(count) : "d"(port) : "memory");
 }
@@ -18,92 +25,508 @@ static inline void outw_rep(uint16_t port, const void *addr, uint32_t count) {
     __asm__ volatile ("rep outsw" : "+S"(addr), "+c"(count) : "d"(port));
 }
 
-static void ata_wait_ready(void) {
-    while (inb(ATA_PRIMARY_STATUS) & ATA_STATUS_BSY);
+// Disable interrupts, returning the previous flags
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
 }
 
-static void ata_wait_drq(void) {
-    while (!(inb(ATA_PRIMARY_STATUS) & ATA_STATUS_DRQ));
+static inline void irq_restore(uint64_t flags) {
+    __asm__ volatile ("push %0; popfq" : : "r"(flags) : "memory", "cc");
 }
 
-static int current_drive = 0;
+struct ata_channel;
 
-void ata_init(void) {
-    // Select primary master drive
-    outb(ATA_PRIMARY_DRIVE_SELECT, 0xA0);
-    current_drive = 0;
+// Per-drive state
+struct ata_device {
+    struct ata_drive_info info;
+    struct ata_channel *ch;
+    struct blockdev blockdev;
+};
+
+// Per-channel state: ports, DMA engine, attached drives and the request queue.
+// A channel runs one request at a time, so the progress of the active
+// request's current command is tracked here rather than in the request.
+// The two channels are independent and run their queues concurrently.
+struct ata_channel {
+    uint16_t base;        // Command block registers
+    uint16_t ctrl;        // Device control register
+    uint16_t bm;          // Bus master registers (0 if no DMA)
+    uint8_t irq;
+    int selected;         // Drive the select register points at (-1 unknown)
+    struct ata_device devices[2];
+
+    struct blk_request *active;
+    struct blk_request *queue_head;
+    struct blk_request *queue_tail;
+
+    // Active request progress
+    uint8_t drive;        // Drive the active request targets
+    uint64_t next_lba;    // First sector not yet issued
+    uint32_t unissued;    // Sectors not yet covered by a command
+    uint32_t cmd_left;    // Sectors left in the current command
+    uint8_t *cmd_buf;     // Start of the current command's data
+    uint8_t *pos;         // PIO position within the current command
+    uint16_t block;       // Sectors per DRQ block of the current command
+    int dma;
+
+    struct ata_prd *prd;
+};
+
+static struct ata_prd prd_tables[2][ATA_PRD_MAX] __attribute__((aligned(256)));
 
-    // Small delay (read status port 4 times)
+static struct ata_channel channels[2] = {
+    { .base = ATA_PRIMARY_DATA,   .ctrl = ATA_PRIMARY_CONTROL,   .irq = ATA_PRIMARY_IRQ,
+      .selected = -1, .prd = prd_tables[0] },
+    { .base = ATA_SECONDARY_BASE, .ctrl = ATA_SECONDARY_CONTROL, .irq = ATA_SECONDARY_IRQ,
+      .selected = -1, .prd = prd_tables[1] },
+};
+
+static void ata_wait_ready(struct ata_channel *ch) {
+    while (inb(ch->base + ATA_REG_STATUS) & ATA_STATUS_BSY);
+}
+
+static void ata_wait_drq(struct ata_channel *ch) {
+    while (!(inb(ch->base + ATA_REG_STATUS) & ATA_STATUS_DRQ));
+}
+
+// ~400ns delay after selecting a drive (read alternate status 4 times)
+static void ata_delay(struct ata_channel *ch) {
     for (int i = 0; i < 4; i++) {
-        inb(ATA_PRIMARY_STATUS);
+        inb(ch->ctrl);
     }
 }
 
-void ata_select_drive(int drive) {
-    current_drive = drive;
-    // 0xA0 for master, 0xB0 for slave
-    outb(ATA_PRIMARY_DRIVE_SELECT, drive ? 0xB0 : 0xA0);
+// Point the channel at a drive. Only a change of drive needs the settle
+// delay; the register keeps its value between commands to the same drive.
+static void ata_select(struct ata_channel *ch, int drive) {
+    if (ch->selected == drive) return;
+    outb(ch->base + ATA_REG_DRIVE_SELECT, drive ? 0xB0 : 0xA0);
+    ata_delay(ch);
+    ch->selected = drive;
+}
 
-    // Small delay
-    for (int i = 0; i < 4; i++) {
-        inb(ATA_PRIMARY_STATUS);
+// Look for a bus-master capable IDE controller on the PCI bus
+static void ata_dma_init(void) {
+    struct pci_device dev;
+
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0, &dev) != 0) return;
+    if (!(dev.prog_if & 0x80)) return;     // No bus master support
+    if (!(dev.bar[4] & 0x01)) return;      // BMIDE must be an I/O BAR
+
+    uint16_t bm_base = dev.bar[4] & 0xFFFC;
+    channels[ATA_CHANNEL_PRIMARY].bm = bm_base;
+    channels[ATA_CHANNEL_SECONDARY].bm = bm_base + 8;
+    pci_enable(&dev, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+}
+
+int ata_dma_available(void) {
+    return channels[ATA_CHANNEL_PRIMARY].bm != 0;
+}
+
+// Run IDENTIFY DEVICE by polling. Returns 0 and fills ident on success.
+static int ata_identify(struct ata_channel *ch, int drive, uint16_t *ident) {
+    if (inb(ch->base + ATA_REG_STATUS) == 0xFF) return -1;  // Floating bus, no drives
+
+    ata_select(ch, drive);
+
+    outb(ch->base + ATA_REG_SECTOR_COUNT, 0);
+    outb(ch->base + ATA_REG_LBA_LOW, 0);
+    outb(ch->base + ATA_REG_LBA_MID, 0);
+    outb(ch->base + ATA_REG_LBA_HIGH, 0);
+    outb(ch->base + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+
+    uint8_t status = inb(ch->base + ATA_REG_STATUS);
+    if (status == 0) return -1;  // No drive
+
+    while (status & ATA_STATUS_BSY) {
+        status = inb(ch->base + ATA_REG_STATUS);
+    }
+
+    // ATAPI and SATA devices set a signature here; they are not ATA disks
+    if (inb(ch->base + ATA_REG_LBA_MID) || inb(ch->base + ATA_REG_LBA_HIGH)) return -1;
+
+    while (!(status & (ATA_STATUS_DRQ | ATA_STATUS_ERR))) {
+        status = inb(ch->base + ATA_REG_STATUS);
+    }
+    if (status & ATA_STATUS_ERR) return -1;
+
+    inw_rep(ch->base + ATA_REG_DATA, ident, 256);
+    return 0;
+}
+
+// Set the DRQ block size used by READ/WRITE MULTIPLE. Returns 0 on success.
+static int ata_set_multiple(struct ata_channel *ch, int drive, uint8_t sectors) {
+    ata_select(ch, drive);
+
+    outb(ch->base + ATA_REG_SECTOR_COUNT, sectors);
+    outb(ch->base + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+    ata_wait_ready(ch);
+
+    return (inb(ch->base + ATA_REG_STATUS) & ATA_STATUS_ERR) ? -1 : 0;
+}
+
+// Fill in drive info from IDENTIFY and negotiate the multiple block size
+static void ata_probe(struct ata_channel *ch, int drive) {
+    struct ata_drive_info *info = &ch->devices[drive].info;
+    uint16_t ident[256];
+
+    // Defaults for a drive that does not answer IDENTIFY: plain LBA28 PIO,
+    // DMA is still attempted and dropped on the first error
+    info->channel = ch - channels;
+    info->drive = drive;
+    info->present = 0;
+    info->lba48 = 0;
+    info->dma = 1;
+    info->multiple = 1;
+    info->sectors = 0;
+
+    if (ata_identify(ch, drive, ident) != 0) return;
+
+    info->present = 1;
+    info->dma = (ident[ATA_IDENT_CAPABILITIES] & (1 << 8)) != 0;
+    info->lba48 = (ident[ATA_IDENT_COMMAND_SETS] & (1 << 10)) != 0;
+
+    if (info->lba48) {
+        info->sectors = (uint64_t)ident[ATA_IDENT_LBA48_SECTORS] |
+                        ((uint64_t)ident[ATA_IDENT_LBA48_SECTORS + 1] << 16) |
+                        ((uint64_t)ident[ATA_IDENT_LBA48_SECTORS + 2] << 32) |
+                        ((uint64_t)ident[ATA_IDENT_LBA48_SECTORS + 3] << 48);
+    } else {
+        info->sectors = (uint32_t)ident[ATA_IDENT_LBA28_SECTORS] |
+                        ((uint32_t)ident[ATA_IDENT_LBA28_SECTORS + 1] << 16);
+    }
+
+    uint8_t max_multiple = ident[ATA_IDENT_MAX_MULTIPLE] & 0xFF;
+    if (max_multiple > 1 && ata_set_multiple(ch, drive, max_multiple) == 0) {
+        info->multiple = max_multiple;
+    }
+}
+
+static void ata_irq(int irq);
+static int ata_submit(struct blockdev *dev, struct blk_request *req);
+
+void ata_init(void) {
+    ata_dma_init();
+
+    for (int c = 0; c < 2; c++) {
+        struct ata_channel *ch = &channels[c];
+
+        // Probe with interrupts off (nIEN), then let the channel raise IRQ14/15
+        outb(ch->ctrl, 0x02);
+        ata_probe(ch, ATA_DRIVE_MASTER);
+        ata_probe(ch, ATA_DRIVE_SLAVE);
+        outb(ch->ctrl, 0x00);
+
+        irq_install_handler(ch->irq, ata_irq);
+        pic_unmask(ch->irq);
+
+        for (int d = 0; d < 2; d++) {
+            struct ata_device *adev = &ch->devices[d];
+            adev->ch = ch;
+
+            struct blockdev *dev = &adev->blockdev;
+            dev->name[0] = 'h';
+            dev->name[1] = 'd';
+            dev->name[2] = 'a' + c * 2 + d;
+            dev->name[3] = 0;
+            dev->sector_size = 512;
+            dev->capacity = adev->info.sectors;
+            dev->submit = ata_submit;
+            dev->poll = 0;
+            dev->private_data = adev;
+
+            if (adev->info.present) {
+                blockdev_register(dev);
+            }
+        }
     }
 }
 
-int ata_read_sectors(uint32_t lba, uint8_t count, void *buffer) {
-    ata_wait_ready();
+const struct ata_drive_info *ata_drive_info(int channel, int drive) {
+    if (channel < 0 || channel > 1 || drive < 0 || drive > 1) return 0;
+    return &channels[channel].devices[drive].info;
+}
 
-    // Select drive and set high LBA bits (0xE0 for master, 0xF0 for slave)
-    uint8_t drive_bits = current_drive ? 0xF0 : 0xE0;
-    outb(ATA_PRIMARY_DRIVE_SELECT, drive_bits | ((lba >> 24) & 0x0F));
+struct blockdev *ata_blockdev(int channel, int drive) {
+    if (channel < 0 || channel > 1 || drive < 0 || drive > 1) return 0;
+    if (!channels[channel].devices[drive].info.present) return 0;
+    return &channels[channel].devices[drive].blockdev;
+}
 
-    // Set sector count
-    outb(ATA_PRIMARY_SECTOR_COUNT, count);
+// Program drive, LBA and sector count, then issue the command
+static void ata_issue(struct ata_channel *ch, uint8_t drive, uint64_t lba, uint32_t count,
+                      uint8_t command, int lba48) {
+    ata_select(ch, drive);
+    ata_wait_ready(ch);
+
+    if (lba48) {
+        // High bytes first, then low bytes, through the same registers
+        outb(ch->base + ATA_REG_DRIVE_SELECT, drive ? 0x50 : 0x40);
+        outb(ch->base + ATA_REG_SECTOR_COUNT, (count >> 8) & 0xFF);
+        outb(ch->base + ATA_REG_LBA_LOW, (lba >> 24) & 0xFF);
+        outb(ch->base + ATA_REG_LBA_MID, (lba >> 32) & 0xFF);
+        outb(ch->base + ATA_REG_LBA_HIGH, (lba >> 40) & 0xFF);
+    } else {
+        // Select drive and set high LBA bits (0xE0 for master, 0xF0 for slave)
+        uint8_t drive_bits = drive ? 0xF0 : 0xE0;
+        outb(ch->base + ATA_REG_DRIVE_SELECT, drive_bits | ((lba >> 24) & 0x0F));
+    }
+
+    // Set sector count (0 means 256, or 65536 for LBA48)
+    outb(ch->base + ATA_REG_SECTOR_COUNT, count & 0xFF);
 
     // Set LBA address
-    outb(ATA_PRIMARY_LBA_LOW, lba & 0xFF);
-    outb(ATA_PRIMARY_LBA_MID, (lba >> 8) & 0xFF);
-    outb(ATA_PRIMARY_LBA_HIGH, (lba >> 16) & 0xFF);
+    outb(ch->base + ATA_REG_LBA_LOW, lba & 0xFF);
+    outb(ch->base + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
+    outb(ch->base + ATA_REG_LBA_HIGH, (lba >> 16) & 0xFF);
+
+    outb(ch->base + ATA_REG_COMMAND, command);
+}
+
+// Describe a buffer as PRD entries, splitting at 64 KB boundaries.
+// Returns 0 if the buffer cannot be described by the table.
+static int ata_build_prd(struct ata_prd *prd, void *buffer, uint32_t bytes) {
+    uint64_t addr = (uint64_t)(uintptr_t)buffer;
+    int n = 0;
+
+    // Controller needs word-aligned buffers below 4 GB
+    if ((addr & 1) || addr + bytes > 0x100000000ULL) return 0;
+
+    while (bytes > 0) {
+        if (n == ATA_PRD_MAX) return 0;
+
+        uint32_t chunk = 0x10000 - (addr & 0xFFFF);  // Up to the next 64 KB boundary
+        if (chunk > bytes) chunk = bytes;
+
+        prd[n].phys_addr = (uint32_t)addr;
+        prd[n].byte_count = chunk & 0xFFFF;     // 64 KB encodes as 0
+        prd[n].flags = 0;
+
+        addr += chunk;
+        bytes -= chunk;
+        n++;
+    }
+
+    if (n == 0) return 0;
+    prd[n - 1].flags = ATA_PRD_EOT;
+    return 1;
+}
+
+static uint8_t ata_pick_command(int write, int dma, int multiple, int lba48) {
+    if (dma) {
+        if (lba48) return write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        return write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    }
+    if (multiple) {
+        if (lba48) return write ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE_EXT;
+        return write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE;
+    }
+    if (lba48) return write ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_READ_SECTORS_EXT;
+    return write ? ATA_CMD_WRITE_SECTORS : ATA_CMD_READ_SECTORS;
+}
+
+// Issue the next command of the active request, covering as many of the
+// remaining sectors as one command allows. Returns -1 if it cannot be issued.
+static int ata_next_command(struct ata_channel *ch, struct blk_request *req) {
+    struct ata_drive_info *info = &ch->devices[ch->drive].info;
+    uint32_t max = info->lba48 ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS;
+    uint32_t n = ch->unissued;
 
-    // Send read command
-    outb(ATA_PRIMARY_COMMAND, ATA_CMD_READ_SECTORS);
+    if (req->flush) {
+        // No data phase; the drive interrupts once its cache is on the media
+        ch->cmd_left = 0;
+        ch->block = 1;
+        ch->dma = 0;
+        ata_issue(ch, ch->drive, 0, 0, info->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE, 0);
+        return 0;
+    }
+
+    int dma = ch->bm && info->dma && !((uintptr_t)ch->pos & 1);
+    if (dma && max > ATA_DMA_MAX_SECTORS) max = ATA_DMA_MAX_SECTORS;
+    if (n > max) n = max;
+
+    // LBA48 costs twice the register writes, so only use it when needed
+    int lba48 = ch->next_lba + n > 0x10000000ULL || n > ATA_LBA28_MAX_SECTORS;
+    if (lba48 && !info->lba48) return -1;
+
+    if (dma && !ata_build_prd(ch->prd, ch->pos, n * 512)) dma = 0;
+
+    ch->cmd_left = n;
+    ch->cmd_buf = ch->pos;
+    ch->block = (!dma && info->multiple > 1) ? info->multiple : 1;
+    ch->dma = dma;
+
+    uint8_t command = ata_pick_command(req->write, dma, ch->block > 1, lba48);
+
+    if (dma) {
+        uint8_t direction = req->write ? 0 : ATA_BM_CMD_READ;
+
+        // Stop the engine, load the PRD table and clear stale status
+        outb(ch->bm + ATA_BM_COMMAND, 0);
+        outl(ch->bm + ATA_BM_PRDT, (uint32_t)(uintptr_t)ch->prd);
+        outb(ch->bm + ATA_BM_STATUS, inb(ch->bm + ATA_BM_STATUS) | ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ);
+        outb(ch->bm + ATA_BM_COMMAND, direction);
 
-    // Read sectors
-    uint16_t *buf = (uint16_t *)buffer;
-    for (int i = 0; i < count; i++) {
-        ata_wait_drq();
-        inw_rep(ATA_PRIMARY_DATA, buf, 256);  // 256 words = 512 bytes
-        buf += 256;
+        ata_issue(ch, ch->drive, ch->next_lba, n, command, lba48);
+        outb(ch->bm + ATA_BM_COMMAND, direction | ATA_BM_CMD_START);
+    } else {
+        ata_issue(ch, ch->drive, ch->next_lba, n, command, lba48);
+
+        if (req->write) {
+            // The first block is sent straight away; the drive interrupts after each one
+            uint32_t block = ch->block < ch->cmd_left ? ch->block : ch->cmd_left;
+            ata_wait_drq(ch);
+            outw_rep(ch->base + ATA_REG_DATA, ch->pos, 256 * block);
+            ch->pos += 512 * block;
+            ch->cmd_left -= block;
+        }
     }
 
+    ch->next_lba += n;
+    ch->unissued -= n;
     return 0;
 }
 
-int ata_write_sectors(uint32_t lba, uint8_t count, const void *buffer) {
-    ata_wait_ready();
+static void ata_start(struct ata_channel *ch);
 
-    // Select drive and set high LBA bits (0xE0 for master, 0xF0 for slave)
-    uint8_t drive_bits = current_drive ? 0xF0 : 0xE0;
-    outb(ATA_PRIMARY_DRIVE_SELECT, drive_bits | ((lba >> 24) & 0x0F));
+static void ata_complete(struct ata_channel *ch, int status) {
+    struct blk_request *req = ch->active;
+    ch->active = 0;
 
-    // Set sector count
-    outb(ATA_PRIMARY_SECTOR_COUNT, count);
+    req->status = status;
+    req->done = 1;
+    if (req->callback) {
+        req->callback(req);
+    }
 
-    // Set LBA address
-    outb(ATA_PRIMARY_LBA_LOW, lba & 0xFF);
-    outb(ATA_PRIMARY_LBA_MID, (lba >> 8) & 0xFF);
-    outb(ATA_PRIMARY_LBA_HIGH, (lba >> 16) & 0xFF);
+    ata_start(ch);
+}
+
+// Current command finished: issue the next one or complete the request
+static void ata_command_done(struct ata_channel *ch, struct blk_request *req) {
+    if (ch->unissued == 0) {
+        ata_complete(ch, 0);
+    } else if (ata_next_command(ch, req) != 0) {
+        ata_complete(ch, -1);
+    }
+}
 
-    // Send write command
-    outb(ATA_PRIMARY_COMMAND, ATA_CMD_WRITE_SECTORS);
+static void ata_start(struct ata_channel *ch) {
+    while (!ch->active && ch->queue_head) {
+        struct blk_request *req = ch->queue_head;
+        ch->queue_head = req->next;
+        if (!ch->queue_head) ch->queue_tail = 0;
+        req->next = 0;
 
-    // Write sectors
-    const uint16_t *buf = (const uint16_t *)buffer;
-    for (int i = 0; i < count; i++) {
-        ata_wait_drq();
-        outw_rep(ATA_PRIMARY_DATA, buf, 256);
-        buf += 256;
+        ch->active = req;
+        ch->drive = ((struct ata_device *)req->dev->private_data)->info.drive;
+        ch->pos = (uint8_t *)req->buffer;
+        ch->next_lba = req->lba;
+        ch->unissued = req->count;
+
+        if (ata_next_command(ch, req) != 0) {
+            ata_complete(ch, -1);
+        }
+    }
+}
+
+static void ata_irq_dma(struct ata_channel *ch, struct blk_request *req) {
+    uint8_t bm_status = inb(ch->bm + ATA_BM_STATUS);
+    if (!(bm_status & (ATA_BM_STATUS_IRQ | ATA_BM_STATUS_ERR))) return;  // Not ours
+
+    outb(ch->bm + ATA_BM_COMMAND, req->write ? 0 : ATA_BM_CMD_READ);  // Stop the engine
+    uint8_t status = inb(ch->base + ATA_REG_STATUS);  // Acknowledges the drive interrupt
+    outb(ch->bm + ATA_BM_STATUS, bm_status | ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ);
+
+    if ((bm_status & ATA_BM_STATUS_ERR) || (status & ATA_STATUS_ERR)) {
+        // Drive aborted the DMA command; rewind, redo it with PIO and
+        // stick to PIO for the drive from now on
+        ch->devices[ch->drive].info.dma = 0;
+        ch->next_lba -= ch->cmd_left;
+        ch->unissued += ch->cmd_left;
+        ch->pos = ch->cmd_buf;
+        if (ata_next_command(ch, req) != 0) {
+            ata_complete(ch, -1);
+        }
+        return;
+    }
+
+    ch->pos = ch->cmd_buf + ch->cmd_left * 512;
+    ch->cmd_left = 0;
+    ata_command_done(ch, req);
+}
+
+static void ata_irq_pio(struct ata_channel *ch, struct blk_request *req) {
+    uint8_t status = inb(ch->base + ATA_REG_STATUS);  // Acknowledges the drive interrupt
+    if (status & ATA_STATUS_BSY) return;
+
+    if (status & ATA_STATUS_ERR) {
+        ata_complete(ch, -1);
+        return;
+    }
+
+    // One interrupt per DRQ block (a single sector unless READ/WRITE MULTIPLE)
+    if (ch->cmd_left > 0) {
+        if (!(status & ATA_STATUS_DRQ)) return;
+
+        uint32_t block = ch->block < ch->cmd_left ? ch->block : ch->cmd_left;
+        if (req->write) {
+            outw_rep(ch->base + ATA_REG_DATA, ch->pos, 256 * block);
+        } else {
+            inw_rep(ch->base + ATA_REG_DATA, ch->pos, 256 * block);
+        }
+        ch->pos += 512 * block;
+        ch->cmd_left -= block;
+
+        // Writes get one more interrupt once the last block is on the disk
+        if (req->write || ch->cmd_left > 0) return;
     }
 
+    ata_command_done(ch, req);
+}
+
+static void ata_irq(int irq) {
+    struct ata_channel *ch = &channels[irq == ATA_PRIMARY_IRQ ? ATA_CHANNEL_PRIMARY : ATA_CHANNEL_SECONDARY];
+    struct blk_request *req = ch->active;
+
+    if (!req) {
+        inb(ch->base + ATA_REG_STATUS);  // Spurious; just acknowledge
+        return;
+    }
+
+    if (ch->dma) {
+        ata_irq_dma(ch, req);
+    } else {
+        ata_irq_pio(ch, req);
+    }
+}
+
+static int ata_submit(struct blockdev *dev, struct blk_request *req) {
+    struct ata_channel *ch = ((struct ata_device *)dev->private_data)->ch;
+
+    uint64_t flags = irq_save();
+    if (ch->queue_tail) {
+        ch->queue_tail->next = req;
+    } else {
+        ch->queue_head = req;
+    }
+    ch->queue_tail = req;
+    ata_start(ch);
+    irq_restore(flags);
+
     return 0;
 }
+
+int ata_read_sectors(int channel, int drive, uint64_t lba, uint32_t count, void *buffer) {
+    struct blockdev *dev = ata_blockdev(channel, drive);
+    if (!dev) return -1;
+    return blockdev_read(dev, lba, count, buffer);
+}
+
+int ata_write_sectors(int channel, int drive, uint64_t lba, uint32_t count, const void *buffer) {
+    struct blockdev *dev = ata_blockdev(channel, drive);
+    if (!dev) return -1;
+    return blockdev_write(dev, lba, count, buffer);
+}
@@ -2,6 +2,7 @@
 #define ATA_H
 
 #include <stdint.h>
+#include "blockdev.h"
 
 // ATA ports (primary bus)
 #define ATA_PRIMARY_DATA         0x1F0
@@ -13,11 +14,56 @@
 #define ATA_PRIMARY_DRIVE_SELECT 0x1F6
 #define ATA_PRIMARY_STATUS       0x1F7
 #define ATA_PRIMARY_COMMAND      0x1F7
+#define ATA_PRIMARY_CONTROL      0x3F6
+
+// ATA ports (secondary bus)
+#define ATA_SECONDARY_BASE       0x170
+#define ATA_SECONDARY_CONTROL    0x376
+
+// Register offsets from a channel's base port
+#define ATA_REG_DATA         0
+#define ATA_REG_ERROR        1
+#define ATA_REG_SECTOR_COUNT 2
+#define ATA_REG_LBA_LOW      3
+#define ATA_REG_LBA_MID      4
+#define ATA_REG_LBA_HIGH     5
+#define ATA_REG_DRIVE_SELECT 6
+#define ATA_REG_STATUS       7
+#define ATA_REG_COMMAND      7
+
+// Channel IRQ lines
+#define ATA_PRIMARY_IRQ   14
+#define ATA_SECONDARY_IRQ 15
 
 // ATA commands
-#define ATA_CMD_READ_SECTORS  0x20
-#define ATA_CMD_WRITE_SECTORS 0x30
-#define ATA_CMD_IDENTIFY      0xEC
+#define ATA_CMD_READ_SECTORS      0x20
+#define ATA_CMD_READ_SECTORS_EXT  0x24
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_SECTORS     0x30
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE     0xC4
+#define ATA_CMD_WRITE_MULTIPLE    0xC5
+#define ATA_CMD_SET_MULTIPLE      0xC6
+#define ATA_CMD_READ_DMA          0xC8
+#define ATA_CMD_WRITE_DMA         0xCA
+#define ATA_CMD_FLUSH_CACHE       0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT   0xEA
+#define ATA_CMD_IDENTIFY          0xEC
+
+// IDENTIFY data word offsets
+#define ATA_IDENT_MAX_MULTIPLE 47   // Bits 7:0 max sectors per DRQ block
+#define ATA_IDENT_CAPABILITIES 49   // Bit 8: DMA supported
+#define ATA_IDENT_CUR_MULTIPLE 59   // Bit 8 valid, bits 7:0 current setting
+#define ATA_IDENT_LBA28_SECTORS 60  // Words 60-61
+#define ATA_IDENT_COMMAND_SETS 83   // Bit 10: LBA48 supported
+#define ATA_IDENT_LBA48_SECTORS 100 // Words 100-103
+
+// Largest request a single command can carry
+#define ATA_LBA28_MAX_SECTORS 256
+#define ATA_LBA48_MAX_SECTORS 65536
 
 // ATA status bits
 #define ATA_STATUS_BSY  0x80  // Busy
@@ -25,13 +71,66 @@
 #define ATA_STATUS_DRQ  0x08  // Data request
 #define ATA_STATUS_ERR  0x01  // Error
 
+// Bus master IDE registers (offsets from BAR4 of the IDE controller)
+#define ATA_BM_COMMAND 0x00
+#define ATA_BM_STATUS  0x02
+#define ATA_BM_PRDT    0x04
+
+// Bus master command bits
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ  0x08  // Device -> memory
+
+// Bus master status bits
+#define ATA_BM_STATUS_ACTIVE 0x01
+#define ATA_BM_STATUS_ERR    0x02
+#define ATA_BM_STATUS_IRQ    0x04
+
+// Physical Region Descriptor: one contiguous chunk of a DMA transfer.
+// A region may not cross a 64 KB boundary; byte_count 0 means 64 KB.
+struct ata_prd {
+    uint32_t phys_addr;
+    uint16_t byte_count;
+    uint16_t flags;       // Bit 15: end of table
+} __attribute__((packed));
+
+#define ATA_PRD_EOT 0x8000
+#define ATA_PRD_MAX 32
+
+// A DMA command is capped so any buffer alignment still fits the PRD table
+#define ATA_DMA_MAX_SECTORS ((ATA_PRD_MAX - 1) * 128)
+
+// What IDENTIFY told us about a drive
+struct ata_drive_info {
+    uint8_t channel;
+    uint8_t drive;
+    int present;
+    int lba48;            // Supports 48-bit LBA commands
+    int dma;              // Supports (and accepts) DMA
+    uint16_t multiple;    // Sectors per DRQ block for READ/WRITE MULTIPLE (1 = off)
+    uint64_t sectors;     // Addressable sectors
+};
+
 // Drive selection
 #define ATA_DRIVE_MASTER 0
 #define ATA_DRIVE_SLAVE  1
 
+// Channel selection
+#define ATA_CHANNEL_PRIMARY   0
+#define ATA_CHANNEL_SECONDARY 1
+
+// Probe both channels and register every ATA disk as a block device
+// (hda/hdb on the primary channel, hdc/hdd on the secondary).
 void ata_init(void);
-void ata_select_drive(int drive);
-int ata_read_sectors(uint32_t lba, uint8_t count, void *buffer);
-int ata_write_sectors(uint32_t lba, uint8_t count, const void *buffer);
+int ata_dma_available(void);
+
+// IDENTIFY results for a drive (0 if the channel/drive is out of range)
+const struct ata_drive_info *ata_drive_info(int channel, int drive);
+
+// Block device for a drive (0 if no disk answered IDENTIFY there)
+struct blockdev *ata_blockdev(int channel, int drive);
+
+// Synchronous transfers on a drive; shorthand for the blockdev calls
+int ata_read_sectors(int channel, int drive, uint64_t lba, uint32_t count, void *buffer);
+int ata_write_sectors(int channel, int drive, uint64_t lba, uint32_t count, const void *buffer);
 
 #endif
@@ -0,0 +1,316 @@
+#include "blockdev.h"
+#include "../heap.h"
+
+// A run of adjacent requests sent to the driver as one transfer. When the
+// parts' buffers are not back to back, the data goes through a bounce buffer.
+struct blk_merge {
+    struct blk_request req;
+    struct blk_request *parts;  // Original requests, in LBA order
+    uint8_t *bounce;            // Allocated on first use
+    int in_use;
+};
+
+static struct blockdev *devices[BLOCKDEV_MAX];
+static int device_count = 0;
+static struct blk_merge merges[BLOCKDEV_MERGE_MAX];
+
+// Disable interrupts, returning the previous flags
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    __asm__ volatile ("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+static int strcmp(const char *a, const char *b) {
+    while (*a && *b && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a - *b;
+}
+
+static void memcpy(void *dest, const void *src, uint32_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    while (n--) *d++ = *s++;
+}
+
+int blockdev_register(struct blockdev *dev) {
+    if (!dev || !dev->submit || device_count >= BLOCKDEV_MAX) return -1;
+    devices[device_count++] = dev;
+    return 0;
+}
+
+int blockdev_count(void) {
+    return device_count;
+}
+
+struct blockdev *blockdev_get(int index) {
+    if (index < 0 || index >= device_count) return 0;
+    return devices[index];
+}
+
+struct blockdev *blockdev_find(const char *name) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i]->name, name) == 0) {
+            return devices[i];
+        }
+    }
+    return 0;
+}
+
+static void blockdev_finish(struct blk_request *req) {
+    req->done = 1;
+    if (req->callback) {
+        req->callback(req);
+    }
+}
+
+// Hand a request to the driver; a refusal completes it with an error
+static void blockdev_start(struct blockdev *dev, struct blk_request *req) {
+    if (dev->submit(dev, req) != 0) {
+        req->status = -1;
+        blockdev_finish(req);
+    }
+}
+
+static void blockdev_merge_done(struct blk_request *req) {
+    struct blk_merge *m = (struct blk_merge *)req->ctx;
+    struct blk_request *part = m->parts;
+    uint32_t sector_size = req->dev->sector_size;
+
+    if (req->buffer == m->bounce && !req->write) {
+        uint8_t *pos = m->bounce;
+        for (struct blk_request *p = part; p; p = p->next) {
+            memcpy(p->buffer, pos, p->count * sector_size);
+            pos += p->count * sector_size;
+        }
+    }
+
+    // Release the slot before completing, so callbacks can submit again
+    uint64_t flags = irq_save();
+    m->parts = 0;
+    m->in_use = 0;
+    irq_restore(flags);
+
+    while (part) {
+        struct blk_request *next = part->next;
+        part->next = 0;
+        part->status = req->status;
+        blockdev_finish(part);
+        part = next;
+    }
+}
+
+// Send a chain of adjacent requests as one. Returns -1 if no merge slot or
+// bounce buffer is available; the caller then submits them one by one.
+static int blockdev_merge(struct blockdev *dev, struct blk_request *parts, uint32_t count, int contiguous) {
+    struct blk_merge *m = 0;
+
+    uint64_t flags = irq_save();
+    for (int i = 0; i < BLOCKDEV_MERGE_MAX; i++) {
+        if (!merges[i].in_use) {
+            m = &merges[i];
+            m->in_use = 1;
+            break;
+        }
+    }
+    irq_restore(flags);
+    if (!m) return -1;
+
+    if (!contiguous && !m->bounce) {
+        m->bounce = kmalloc(BLOCKDEV_MERGE_MAX_SECTORS * 512);
+        if (!m->bounce) {
+            m->in_use = 0;
+            return -1;
+        }
+    }
+
+    struct blk_request *req = &m->req;
+    req->dev = dev;
+    req->lba = parts->lba;
+    req->count = count;
+    req->buffer = contiguous ? parts->buffer : m->bounce;
+    req->write = parts->write;
+    req->flush = 0;
+    req->done = 0;
+    req->status = 0;
+    req->callback = blockdev_merge_done;
+    req->ctx = m;
+    req->next = 0;
+    req->pending = 0;
+    m->parts = parts;
+
+    if (!contiguous && req->write) {
+        uint8_t *pos = m->bounce;
+        for (struct blk_request *p = parts; p; p = p->next) {
+            memcpy(pos, p->buffer, p->count * dev->sector_size);
+            pos += p->count * dev->sector_size;
+        }
+    }
+
+    blockdev_start(dev, req);
+    return 0;
+}
+
+// Insert into the held-back queue, sorted by LBA after the last flush
+static void blockdev_elevator_add(struct blockdev *dev, struct blk_request *req) {
+    uint64_t flags = irq_save();
+    struct blk_request **link = dev->queue_barrier ? &dev->queue_barrier->next : &dev->queue;
+
+    if (req->flush) {
+        while (*link) link = &(*link)->next;
+        dev->queue_barrier = req;
+    } else {
+        while (*link && (*link)->lba <= req->lba) link = &(*link)->next;
+    }
+
+    req->next = *link;
+    *link = req;
+    irq_restore(flags);
+}
+
+// Move the held-back queue to the driver, merging runs of adjacent requests
+static void blockdev_dispatch(struct blockdev *dev) {
+    uint64_t flags = irq_save();
+    struct blk_request *req = dev->queue;
+    dev->queue = 0;
+    dev->queue_barrier = 0;
+    irq_restore(flags);
+
+    while (req) {
+        struct blk_request *last = req;
+        struct blk_request *next = req->next;
+        uint32_t count = req->count;
+        int contiguous = 1;
+
+        while (!req->flush && next && !next->flush && next->write == req->write &&
+               next->lba == last->lba + last->count &&
+               count + next->count <= BLOCKDEV_MERGE_MAX_SECTORS) {
+            if ((uint8_t *)last->buffer + last->count * dev->sector_size != next->buffer) {
+                contiguous = 0;
+            }
+            count += next->count;
+            last = next;
+            next = next->next;
+        }
+        last->next = 0;
+
+        // Bounce buffers are sized for 512-byte sectors
+        if (last == req || (!contiguous && dev->sector_size != 512) ||
+            blockdev_merge(dev, req, count, contiguous) != 0) {
+            while (req) {
+                struct blk_request *n = req->next;
+                req->next = 0;
+                blockdev_start(dev, req);
+                req = n;
+            }
+        }
+        req = next;
+    }
+
+    if (dev->commit) {
+        dev->commit(dev);
+    }
+}
+
+int blockdev_submit(struct blockdev *dev, struct blk_request *req) {
+    if (!dev || !req) return -1;
+    if (!req->flush) {
+        if (req->count == 0) return -1;
+        if (req->lba + req->count > dev->capacity) return -1;
+    }
+
+    req->dev = dev;
+    req->done = 0;
+    req->status = 0;
+    req->next = 0;
+    req->pending = 0;
+
+    if (dev->plugged) {
+        blockdev_elevator_add(dev, req);
+        return 0;
+    }
+
+    if (dev->submit(dev, req) != 0) return -1;
+    if (dev->commit) {
+        dev->commit(dev);
+    }
+    return 0;
+}
+
+void blockdev_plug(struct blockdev *dev) {
+    dev->plugged++;
+}
+
+void blockdev_unplug(struct blockdev *dev) {
+    if (dev->plugged > 0 && --dev->plugged == 0) {
+        blockdev_dispatch(dev);
+    }
+}
+
+int blockdev_wait(struct blockdev *dev, struct blk_request *req) {
+    // Waiting on a held-back request would never finish
+    if (dev->queue) {
+        blockdev_dispatch(dev);
+    }
+
+    while (!req->done) {
+        if (dev->poll) {
+            dev->poll(dev);
+            continue;
+        }
+
+        // sti only takes effect after the next instruction, so an interrupt
+        // landing between the check and hlt still wakes us up
+        __asm__ volatile ("cli");
+        if (req->done) {
+            __asm__ volatile ("sti");
+            break;
+        }
+        __asm__ volatile ("sti; hlt" : : : "memory");
+    }
+    return req->status;
+}
+
+static int blockdev_transfer(struct blockdev *dev, uint64_t lba, uint32_t count, void *buffer, int write) {
+    if (count == 0) return 0;
+
+    struct blk_request req;
+    req.lba = lba;
+    req.count = count;
+    req.buffer = buffer;
+    req.write = write;
+    req.flush = 0;
+    req.callback = 0;
+    req.ctx = 0;
+
+    if (blockdev_submit(dev, &req) != 0) return -1;
+    return blockdev_wait(dev, &req);
+}
+
+int blockdev_read(struct blockdev *dev, uint64_t lba, uint32_t count, void *buffer) {
+    return blockdev_transfer(dev, lba, count, buffer, 0);
+}
+
+int blockdev_write(struct blockdev *dev, uint64_t lba, uint32_t count, const void *buffer) {
+    return blockdev_transfer(dev, lba, count, (void *)buffer, 1);
+}
+
+int blockdev_flush(struct blockdev *dev) {
+    struct blk_request req;
+    req.lba = 0;
+    req.count = 0;
+    req.buffer = 0;
+    req.write = 0;
+    req.flush = 1;
+    req.callback = 0;
+    req.ctx = 0;
+
+    if (blockdev_submit(dev, &req) != 0) return -1;
+    return blockdev_wait(dev, &req);
+}
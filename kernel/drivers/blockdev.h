@@ -0,0 +1,85 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdint.h>
+
+#define BLOCKDEV_MAX      8
+#define BLOCKDEV_NAME_LEN 8
+
+// Elevator merging: at most this many merged requests in flight at once,
+// each covering up to BLOCKDEV_MERGE_MAX_SECTORS
+#define BLOCKDEV_MERGE_MAX         8
+#define BLOCKDEV_MERGE_MAX_SECTORS 256
+
+// Forward declarations
+struct blockdev;
+struct blk_request;
+
+// Function pointer types for driver operations
+typedef int (*blk_submit_fn)(struct blockdev *, struct blk_request *);
+typedef void (*blk_poll_fn)(struct blockdev *);
+typedef void (*blk_commit_fn)(struct blockdev *);
+
+// Transfer request. The caller owns the memory and must keep it alive until
+// done is set. The callback (optional) runs in interrupt context.
+struct blk_request {
+    struct blockdev *dev;     // Set by blockdev_submit
+    uint64_t lba;
+    uint32_t count;           // Sectors
+    void *buffer;
+    uint8_t write;            // 0 = read, 1 = write
+    uint8_t flush;            // Write back the drive's cache (lba/count unused)
+
+    volatile int done;        // Set once the request has completed
+    int status;               // 0 on success, -1 on error
+    void (*callback)(struct blk_request *req);
+    void *ctx;                // Caller data for the callback
+
+    // Driver bookkeeping
+    struct blk_request *next;
+    uint32_t pending;         // Commands still in flight for this request
+};
+
+// Block device (disk)
+struct blockdev {
+    char name[BLOCKDEV_NAME_LEN];
+    uint32_t sector_size;
+    uint64_t capacity;        // In sectors
+
+    // Operations
+    blk_submit_fn submit;     // Queue a request; completion via done/callback
+    blk_commit_fn commit;     // Optional: start everything submitted so far
+    blk_poll_fn poll;         // Optional: reap completions when the device has no IRQ
+
+    // Elevator: while plugged, submitted requests wait here sorted by LBA.
+    // A flush is a barrier; nothing is sorted across it.
+    int plugged;
+    struct blk_request *queue;
+    struct blk_request *queue_barrier;  // Last flush in the queue
+
+    // Driver-specific data
+    void *private_data;
+};
+
+int blockdev_register(struct blockdev *dev);
+int blockdev_count(void);
+struct blockdev *blockdev_get(int index);
+struct blockdev *blockdev_find(const char *name);
+
+// Asynchronous interface
+int blockdev_submit(struct blockdev *dev, struct blk_request *req);
+int blockdev_wait(struct blockdev *dev, struct blk_request *req);
+
+// Batch submissions: between plug and unplug, requests are held in the
+// device's queue. Unplugging sorts and merges adjacent requests, hands the
+// result to the driver and lets it start the whole batch at once. Requests
+// in one batch may be reordered, so they must not overlap.
+void blockdev_plug(struct blockdev *dev);
+void blockdev_unplug(struct blockdev *dev);
+
+// Synchronous interface
+int blockdev_read(struct blockdev *dev, uint64_t lba, uint32_t count, void *buffer);
+int blockdev_write(struct blockdev *dev, uint64_t lba, uint32_t count, const void *buffer);
+int blockdev_flush(struct blockdev *dev);
+
+#endif
@@ -1,4 +1,5 @@
 #include "keyboard.h"
+#include "timer.h"
 
 // Circular buffer for key events
 #define KEY_BUFFER_SIZE 64
@@ -169,8 +170,10 @@ int keyboard_has_event(void) {
 }
 
 struct key_event keyboard_get_event(void) {
-    // Wait for event
+    // Wait for event; idle time goes to deferred timer work
     while (!keyboard_has_event()) {
+        timer_run_pending();
+        if (keyboard_has_event()) break;
         __asm__ volatile ("hlt");
     }
 
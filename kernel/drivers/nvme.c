@@ -0,0 +1,454 @@
+#include "nvme.h"
+#include "pci.h"
+#include "../heap.h"
+#include "../idt.h"
+#include "../isr.h"
+
+// Disable interrupts, returning the previous flags
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    __asm__ volatile ("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+// A submission/completion queue pair
+struct nvme_queue {
+    struct nvme_sqe *sq;
+    volatile struct nvme_cqe *cq;
+    volatile uint32_t *sq_doorbell;
+    volatile uint32_t *cq_doorbell;
+    uint16_t size;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;           // Phase tag expected in new completions
+};
+
+struct nvme_ns {
+    uint32_t nsid;
+    struct blockdev blockdev;
+};
+
+// Controller state. There is a single CPU, so one I/O queue pair serves all
+// namespaces. Every command id doubles as a slot with its own PRP list page;
+// requests that do not fit wait in a FIFO whose head may be partially issued.
+struct nvme_ctrl {
+    volatile uint8_t *regs;
+    uint32_t doorbell_stride;
+
+    struct nvme_queue admin;
+    struct nvme_queue io;
+    uint32_t max_sectors;     // Per command, from MDTS
+
+    uint16_t slots;
+    uint16_t free_count;
+    uint16_t *free_slots;     // Stack of unused command ids
+    struct blk_request **slot_req;
+    uint64_t *prp_lists;      // One page of PRP entries per slot
+    uint16_t unsubmitted;     // SQ entries written since the last doorbell
+
+    struct blk_request *queue_head;
+    struct blk_request *queue_tail;
+    uint64_t head_lba;        // Next sector of the queue head to issue
+    uint32_t head_left;       // Sectors of the queue head not yet issued
+    uint8_t *head_pos;
+};
+
+static struct nvme_ctrl ctrl;
+static struct nvme_ns namespaces[NVME_MAX_DISKS];
+static int ns_count = 0;
+
+static inline uint32_t nvme_read32(uint32_t reg) {
+    return *(volatile uint32_t *)(ctrl.regs + reg);
+}
+
+static inline void nvme_write32(uint32_t reg, uint32_t val) {
+    *(volatile uint32_t *)(ctrl.regs + reg) = val;
+}
+
+static inline uint64_t nvme_read64(uint32_t reg) {
+    return (uint64_t)nvme_read32(reg) | ((uint64_t)nvme_read32(reg + 4) << 32);
+}
+
+static inline void nvme_write64(uint32_t reg, uint64_t val) {
+    nvme_write32(reg, (uint32_t)val);
+    nvme_write32(reg + 4, (uint32_t)(val >> 32));
+}
+
+static int nvme_queue_alloc(struct nvme_queue *q, uint16_t qid, uint16_t size) {
+    q->sq = kmalloc_aligned(sizeof(struct nvme_sqe) * size, 4096);
+    q->cq = kmalloc_aligned(sizeof(struct nvme_cqe) * size, 4096);
+    if (!q->sq || !q->cq) return -1;
+
+    q->sq_doorbell = (volatile uint32_t *)(ctrl.regs + NVME_REG_DOORBELL + (2 * qid) * ctrl.doorbell_stride);
+    q->cq_doorbell = (volatile uint32_t *)(ctrl.regs + NVME_REG_DOORBELL + (2 * qid + 1) * ctrl.doorbell_stride);
+    q->size = size;
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    return 0;
+}
+
+// Copy a command into the next SQ entry (doorbell not rung)
+static void nvme_queue_push(struct nvme_queue *q, const struct nvme_sqe *cmd) {
+    q->sq[q->sq_tail] = *cmd;
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+}
+
+// Next completion if the controller has posted one, else 0
+static volatile struct nvme_cqe *nvme_queue_peek(struct nvme_queue *q) {
+    volatile struct nvme_cqe *cqe = &q->cq[q->cq_head];
+    if ((cqe->status & 1) != q->phase) return 0;
+    return cqe;
+}
+
+static void nvme_queue_advance(struct nvme_queue *q) {
+    q->cq_head++;
+    if (q->cq_head == q->size) {
+        q->cq_head = 0;
+        q->phase ^= 1;
+    }
+}
+
+// Run one admin command and poll for its completion. Returns 0 on success.
+static int nvme_admin(struct nvme_sqe *cmd) {
+    struct nvme_queue *q = &ctrl.admin;
+    cmd->cid = q->sq_tail;
+    nvme_queue_push(q, cmd);
+    __asm__ volatile ("" : : : "memory");
+    *q->sq_doorbell = q->sq_tail;
+
+    volatile struct nvme_cqe *cqe;
+    while (!(cqe = nvme_queue_peek(q)));
+    int status = cqe->status >> 1;
+    nvme_queue_advance(q);
+    *q->cq_doorbell = q->cq_head;
+
+    return status ? -1 : 0;
+}
+
+static int nvme_identify(uint32_t nsid, uint32_t cns, void *buffer) {
+    struct nvme_sqe cmd = {0};
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = (uint64_t)(uintptr_t)buffer;
+    cmd.cdw10 = cns;
+    return nvme_admin(&cmd);
+}
+
+static void nvme_complete(struct blk_request *req) {
+    req->done = 1;
+    if (req->callback) {
+        req->callback(req);
+    }
+}
+
+// Describe a buffer with PRP entries. Returns 0 on success.
+static int nvme_build_prps(struct nvme_sqe *cmd, uint64_t *list, uint8_t *buffer, uint32_t bytes) {
+    uint64_t addr = (uint64_t)(uintptr_t)buffer;
+    if (addr & 3) return -1;  // PRPs must be dword aligned
+
+    cmd->prp1 = addr;
+    uint32_t first = 4096 - (addr & 0xFFF);
+    if (bytes <= first) {
+        cmd->prp2 = 0;
+        return 0;
+    }
+
+    addr = (addr + first) & ~0xFFFull;
+    bytes -= first;
+    if (bytes <= 4096) {
+        cmd->prp2 = addr;
+        return 0;
+    }
+
+    // More than two pages: prp2 points at the slot's list
+    uint32_t n = 0;
+    while (bytes > 0) {
+        list[n++] = addr;
+        addr += 4096;
+        bytes = bytes > 4096 ? bytes - 4096 : 0;
+    }
+    cmd->prp2 = (uint64_t)(uintptr_t)list;
+    return 0;
+}
+
+static void nvme_pop_head(void) {
+    struct blk_request *req = ctrl.queue_head;
+    ctrl.queue_head = req->next;
+    if (!ctrl.queue_head) ctrl.queue_tail = 0;
+    req->next = 0;
+    if (req->pending == 0) nvme_complete(req);
+
+    if (ctrl.queue_head) {
+        ctrl.head_lba = ctrl.queue_head->lba;
+        ctrl.head_left = ctrl.queue_head->count;
+        ctrl.head_pos = (uint8_t *)ctrl.queue_head->buffer;
+    }
+}
+
+// Write SQ entries for queued requests while command ids are free
+static void nvme_fill(void) {
+    while (ctrl.queue_head && ctrl.free_count > 0) {
+        struct blk_request *req = ctrl.queue_head;
+        struct nvme_ns *ns = (struct nvme_ns *)req->dev->private_data;
+        uint32_t n = ctrl.head_left > ctrl.max_sectors ? ctrl.max_sectors : ctrl.head_left;
+        uint16_t slot = ctrl.free_slots[ctrl.free_count - 1];
+
+        struct nvme_sqe cmd = {0};
+        cmd.cid = slot;
+        cmd.nsid = ns->nsid;
+        int ok = 1;
+        if (req->flush) {
+            cmd.opcode = NVME_CMD_FLUSH;
+        } else {
+            cmd.opcode = req->write ? NVME_CMD_WRITE : NVME_CMD_READ;
+            cmd.cdw10 = (uint32_t)ctrl.head_lba;
+            cmd.cdw11 = (uint32_t)(ctrl.head_lba >> 32);
+            cmd.cdw12 = n - 1;
+            ok = nvme_build_prps(&cmd, &ctrl.prp_lists[slot * 512], ctrl.head_pos, n * 512) == 0;
+        }
+
+        if (!ok) {
+            req->status = -1;
+            n = ctrl.head_left;  // Skip the rest of this request
+        } else {
+            ctrl.free_count--;
+            ctrl.slot_req[slot] = req;
+            req->pending++;
+            nvme_queue_push(&ctrl.io, &cmd);
+            ctrl.unsubmitted++;
+        }
+
+        ctrl.head_lba += n;
+        ctrl.head_pos += n * 512;
+        ctrl.head_left -= n;
+        if (ctrl.head_left == 0) {
+            nvme_pop_head();
+        }
+    }
+}
+
+// Ring the SQ doorbell once for everything written since the last kick
+static void nvme_kick(void) {
+    nvme_fill();
+    if (ctrl.unsubmitted == 0) return;
+
+    __asm__ volatile ("" : : : "memory");
+    *ctrl.io.sq_doorbell = ctrl.io.sq_tail;
+    ctrl.unsubmitted = 0;
+}
+
+// Reap I/O completions, then refill the freed command ids
+static void nvme_service(void) {
+    struct nvme_queue *q = &ctrl.io;
+    volatile struct nvme_cqe *cqe;
+    int reaped = 0;
+
+    while ((cqe = nvme_queue_peek(q)) != 0) {
+        uint16_t slot = cqe->cid;
+        int status = cqe->status >> 1;
+        nvme_queue_advance(q);
+        reaped++;
+
+        if (slot >= ctrl.slots) continue;
+        struct blk_request *req = ctrl.slot_req[slot];
+        ctrl.slot_req[slot] = 0;
+        ctrl.free_slots[ctrl.free_count++] = slot;
+        if (!req) continue;
+
+        if (status) req->status = -1;
+        req->pending--;
+        if (req->pending == 0 && req != ctrl.queue_head) {
+            nvme_complete(req);
+        }
+    }
+
+    if (reaped) {
+        *q->cq_doorbell = q->cq_head;
+    }
+
+    // Plugging holds requests back in the elevator, never here
+    nvme_kick();
+}
+
+static void nvme_irq(int irq) {
+    (void)irq;
+    if (ns_count == 0) return;  // Shared line, or we never finished init
+    nvme_service();
+}
+
+static void nvme_poll(struct blockdev *dev) {
+    (void)dev;
+    uint64_t flags = irq_save();
+    nvme_service();
+    irq_restore(flags);
+}
+
+static int nvme_submit(struct blockdev *dev, struct blk_request *req) {
+    (void)dev;
+
+    uint64_t flags = irq_save();
+    if (ctrl.queue_tail) {
+        ctrl.queue_tail->next = req;
+    } else {
+        ctrl.queue_head = req;
+        ctrl.head_lba = req->lba;
+        ctrl.head_left = req->count;
+        ctrl.head_pos = (uint8_t *)req->buffer;
+    }
+    ctrl.queue_tail = req;
+    irq_restore(flags);
+
+    return 0;
+}
+
+static void nvme_commit(struct blockdev *dev) {
+    (void)dev;
+    uint64_t flags = irq_save();
+    nvme_kick();
+    irq_restore(flags);
+}
+
+// Reset the controller and bring up the admin queue. Returns 0 on success.
+static int nvme_enable(uint64_t cap) {
+    nvme_write32(NVME_REG_CC, 0);
+    while (nvme_read32(NVME_REG_CSTS) & NVME_CSTS_RDY);
+
+    if (nvme_queue_alloc(&ctrl.admin, 0, NVME_ADMIN_QUEUE_DEPTH) != 0) return -1;
+    nvme_write32(NVME_REG_AQA, ((NVME_ADMIN_QUEUE_DEPTH - 1) << 16) | (NVME_ADMIN_QUEUE_DEPTH - 1));
+    nvme_write64(NVME_REG_ASQ, (uint64_t)(uintptr_t)ctrl.admin.sq);
+    nvme_write64(NVME_REG_ACQ, (uint64_t)(uintptr_t)ctrl.admin.cq);
+
+    // NVM command set, 4 KB pages (CAP.MPSMIN is 4 KB on anything we'd meet)
+    if ((cap >> 48) & 0xF) return -1;
+    nvme_write32(NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+
+    uint32_t csts;
+    while (!((csts = nvme_read32(NVME_REG_CSTS)) & NVME_CSTS_RDY)) {
+        if (csts & NVME_CSTS_CFS) return -1;
+    }
+    return 0;
+}
+
+// Create I/O queue pair 1 and its command slots
+static int nvme_create_io_queue(uint64_t cap, int use_irq) {
+    uint32_t depth = NVME_IO_QUEUE_DEPTH;
+    uint32_t mqes = (uint32_t)(cap & 0xFFFF) + 1;
+    if (depth > mqes) depth = mqes;
+    if (depth > NVME_MAX_QUEUE_DEPTH) depth = NVME_MAX_QUEUE_DEPTH;
+    if (depth < 2) return -1;
+
+    if (nvme_queue_alloc(&ctrl.io, 1, depth) != 0) return -1;
+
+    struct nvme_sqe cmd = {0};
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = (uint64_t)(uintptr_t)ctrl.io.cq;
+    cmd.cdw10 = ((depth - 1) << 16) | 1;
+    cmd.cdw11 = use_irq ? 0x3 : 0x1;  // Physically contiguous, interrupts on vector 0
+    if (nvme_admin(&cmd) != 0) return -1;
+
+    struct nvme_sqe sq_cmd = {0};
+    sq_cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    sq_cmd.prp1 = (uint64_t)(uintptr_t)ctrl.io.sq;
+    sq_cmd.cdw10 = ((depth - 1) << 16) | 1;
+    sq_cmd.cdw11 = (1 << 16) | 0x1;   // Completions go to CQ 1
+    if (nvme_admin(&sq_cmd) != 0) return -1;
+
+    // A full SQ is one entry short of its size
+    ctrl.slots = depth - 1;
+    ctrl.free_slots = kmalloc(sizeof(uint16_t) * ctrl.slots);
+    ctrl.slot_req = kmalloc(sizeof(struct blk_request *) * ctrl.slots);
+    ctrl.prp_lists = kmalloc_aligned(4096 * ctrl.slots, 4096);
+    if (!ctrl.free_slots || !ctrl.slot_req || !ctrl.prp_lists) return -1;
+
+    for (uint16_t i = 0; i < ctrl.slots; i++) {
+        ctrl.free_slots[i] = ctrl.slots - 1 - i;
+    }
+    ctrl.free_count = ctrl.slots;
+    return 0;
+}
+
+// Register namespaces that use 512-byte sectors
+static void nvme_scan_namespaces(uint32_t count, uint8_t *ident) {
+    for (uint32_t nsid = 1; nsid <= count && ns_count < NVME_MAX_DISKS; nsid++) {
+        if (nvme_identify(nsid, NVME_IDENTIFY_NAMESPACE, ident) != 0) continue;
+
+        uint64_t size = *(uint64_t *)ident;
+        uint8_t format = ident[26] & 0x0F;
+        uint8_t lba_shift = ident[128 + format * 4 + 2];
+        if (size == 0 || lba_shift != 9) continue;
+
+        struct nvme_ns *ns = &namespaces[ns_count];
+        ns->nsid = nsid;
+
+        struct blockdev *dev = &ns->blockdev;
+        dev->name[0] = 'n';
+        dev->name[1] = 'v';
+        dev->name[2] = 'm';
+        dev->name[3] = 'e';
+        dev->name[4] = '0' + ns_count;
+        dev->name[5] = 0;
+        dev->sector_size = 512;
+        dev->capacity = size;
+        dev->submit = nvme_submit;
+        dev->commit = nvme_commit;
+        dev->private_data = ns;
+        ns_count++;
+    }
+}
+
+int nvme_init(void) {
+    struct pci_device pdev;
+    int found = 0;
+
+    for (int i = 0; pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM, i, &pdev) == 0; i++) {
+        if (pdev.prog_if == NVME_PROG_IF) {
+            found = 1;
+            break;
+        }
+    }
+    if (!found) return 0;
+
+    // BAR0 is usually 64-bit; only the low 4 GB are mapped
+    uint64_t base = pdev.bar[0] & 0xFFFFFFF0;
+    if ((pdev.bar[0] & 0x6) == 0x4) base |= (uint64_t)pdev.bar[1] << 32;
+    if (base == 0 || base >= 0x100000000ull) return 0;
+
+    pci_enable(&pdev, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+    ctrl.regs = (volatile uint8_t *)(uintptr_t)base;
+
+    uint64_t cap = nvme_read64(NVME_REG_CAP);
+    ctrl.doorbell_stride = 4u << ((cap >> 32) & 0xF);
+    if (nvme_enable(cap) != 0) return 0;
+
+    uint8_t *ident = kmalloc_aligned(4096, 4096);
+    if (!ident || nvme_identify(0, NVME_IDENTIFY_CONTROLLER, ident) != 0) return 0;
+
+    // MDTS is a power of two in units of the 4 KB page size (0 = no limit)
+    ctrl.max_sectors = NVME_CMD_MAX_SECTORS;
+    uint8_t mdts = ident[77];
+    if (mdts && mdts < 16 && (8u << mdts) < ctrl.max_sectors) {
+        ctrl.max_sectors = 8u << mdts;
+    }
+    uint32_t ns_total = *(uint32_t *)(ident + 516);
+
+    int irq = pdev.irq_line;
+    int use_irq = irq > 0 && irq < 16 && irq_install_handler(irq, nvme_irq) == 0;
+    if (nvme_create_io_queue(cap, use_irq) != 0) return 0;
+
+    nvme_scan_namespaces(ns_total, ident);
+    for (int i = 0; i < ns_count; i++) {
+        namespaces[i].blockdev.poll = use_irq ? 0 : nvme_poll;
+        blockdev_register(&namespaces[i].blockdev);
+    }
+    if (use_irq) {
+        nvme_write32(NVME_REG_INTMC, 1);
+        pic_unmask(irq);
+    }
+
+    return ns_count;
+}
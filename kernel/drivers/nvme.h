@@ -0,0 +1,90 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+// PCI identification (mass storage / NVM / NVMe)
+#define PCI_SUBCLASS_NVM 0x08
+#define NVME_PROG_IF     0x02
+
+// I/O queue entries. Build with -DNVME_IO_QUEUE_DEPTH=n to benchmark other
+// depths; it is clamped to what the controller supports (CAP.MQES).
+#ifndef NVME_IO_QUEUE_DEPTH
+#define NVME_IO_QUEUE_DEPTH 64
+#endif
+
+// Limits
+#define NVME_MAX_DISKS          4     // Namespaces registered as block devices
+#define NVME_ADMIN_QUEUE_DEPTH  8
+#define NVME_MAX_QUEUE_DEPTH    1024  // Largest I/O queue we allocate for
+#define NVME_CMD_MAX_SECTORS    1024  // Sectors per command (before MDTS)
+
+// Controller registers (offsets into BAR0)
+#define NVME_REG_CAP   0x00  // Capabilities (64-bit)
+#define NVME_REG_VS    0x08
+#define NVME_REG_INTMS 0x0C
+#define NVME_REG_INTMC 0x10
+#define NVME_REG_CC    0x14  // Configuration
+#define NVME_REG_CSTS  0x1C  // Status
+#define NVME_REG_AQA   0x24  // Admin queue attributes
+#define NVME_REG_ASQ   0x28  // Admin submission queue base (64-bit)
+#define NVME_REG_ACQ   0x30  // Admin completion queue base (64-bit)
+#define NVME_REG_DOORBELL 0x1000
+
+// CC bits
+#define NVME_CC_EN     0x00000001
+#define NVME_CC_IOSQES (6 << 16)  // 64-byte submission entries
+#define NVME_CC_IOCQES (4 << 20)  // 16-byte completion entries
+
+// CSTS bits
+#define NVME_CSTS_RDY 0x01
+#define NVME_CSTS_CFS 0x02  // Controller fatal status
+
+// Admin commands
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY  0x06
+
+// Identify CNS values
+#define NVME_IDENTIFY_NAMESPACE  0x00
+#define NVME_IDENTIFY_CONTROLLER 0x01
+
+// NVM commands
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ  0x02
+
+// Submission queue entry
+struct nvme_sqe {
+    uint8_t  opcode;
+    uint8_t  flags;
+    uint16_t cid;         // Command identifier, echoed in the completion
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed));
+
+// Completion queue entry
+struct nvme_cqe {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;     // How far the controller has consumed the SQ
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;      // Bit 0: phase tag, bits 15:1 status
+} __attribute__((packed));
+
+// Find the first NVMe controller and register its namespaces (nvme0, nvme1,
+// ...) as block devices. Returns the number of namespaces found.
+int nvme_init(void);
+
+#endif
@@ -0,0 +1,104 @@
+#include "pci.h"
+
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static uint32_t pci_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    return (1u << 31) | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+           ((uint32_t)func << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_config_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint16_t pci_config_read16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t val = pci_config_read32(bus, slot, func, offset);
+    return (val >> ((offset & 2) * 8)) & 0xFFFF;
+}
+
+uint8_t pci_config_read8(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t val = pci_config_read32(bus, slot, func, offset);
+    return (val >> ((offset & 3) * 8)) & 0xFF;
+}
+
+void pci_config_write32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_config_write16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t value) {
+    uint32_t val = pci_config_read32(bus, slot, func, offset);
+    int shift = (offset & 2) * 8;
+    val &= ~(0xFFFFu << shift);
+    val |= (uint32_t)value << shift;
+    pci_config_write32(bus, slot, func, offset, val);
+}
+
+// Fill a device record from configuration space
+static void pci_read_device(uint8_t bus, uint8_t slot, uint8_t func, struct pci_device *out) {
+    out->bus = bus;
+    out->slot = slot;
+    out->func = func;
+    out->vendor_id = pci_config_read16(bus, slot, func, PCI_VENDOR_ID);
+    out->device_id = pci_config_read16(bus, slot, func, PCI_DEVICE_ID);
+    out->class_code = pci_config_read8(bus, slot, func, PCI_CLASS);
+    out->subclass = pci_config_read8(bus, slot, func, PCI_SUBCLASS);
+    out->prog_if = pci_config_read8(bus, slot, func, PCI_PROG_IF);
+    out->irq_line = pci_config_read8(bus, slot, func, PCI_INTERRUPT_LINE);
+    for (int i = 0; i < 6; i++) {
+        out->bar[i] = pci_config_read32(bus, slot, func, PCI_BAR0 + i * 4);
+    }
+}
+
+// Walk every function on every bus; stop at the index-th one accepted by match
+static int pci_scan(int (*match)(struct pci_device *, uint32_t, uint32_t),
+                    uint32_t a, uint32_t b, int index, struct pci_device *out) {
+    for (int bus = 0; bus < 256; bus++) {
+        for (int slot = 0; slot < 32; slot++) {
+            if (pci_config_read16(bus, slot, 0, PCI_VENDOR_ID) == 0xFFFF) continue;
+
+            // Only probe functions 1-7 on multi-function devices
+            int funcs = (pci_config_read8(bus, slot, 0, PCI_HEADER_TYPE) & 0x80) ? 8 : 1;
+            for (int func = 0; func < funcs; func++) {
+                if (pci_config_read16(bus, slot, func, PCI_VENDOR_ID) == 0xFFFF) continue;
+
+                pci_read_device(bus, slot, func, out);
+                if (match(out, a, b)) {
+                    if (index == 0) return 0;
+                    index--;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+static int match_class(struct pci_device *dev, uint32_t class_code, uint32_t subclass) {
+    return dev->class_code == class_code && dev->subclass == subclass;
+}
+
+static int match_id(struct pci_device *dev, uint32_t vendor_id, uint32_t device_id) {
+    return dev->vendor_id == vendor_id && dev->device_id == device_id;
+}
+
+int pci_find_class(uint8_t class_code, uint8_t subclass, int index, struct pci_device *out) {
+    return pci_scan(match_class, class_code, subclass, index, out);
+}
+
+int pci_find_device(uint16_t vendor_id, uint16_t device_id, int index, struct pci_device *out) {
+    return pci_scan(match_id, vendor_id, device_id, index, out);
+}
+
+void pci_enable(struct pci_device *dev, uint16_t bits) {
+    uint16_t cmd = pci_config_read16(dev->bus, dev->slot, dev->func, PCI_COMMAND);
+    pci_config_write16(dev->bus, dev->slot, dev->func, PCI_COMMAND, cmd | bits);
+}
@@ -0,0 +1,75 @@
+#include "timer.h"
+#include "../idt.h"
+#include "../isr.h"
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static volatile uint64_t ticks = 0;
+
+struct timer_callback {
+    timer_fn fn;
+    uint32_t interval_ms;  // 0 = stopped
+    uint64_t due_ms;
+};
+
+static struct timer_callback callbacks[TIMER_MAX_CALLBACKS];
+static int callback_count = 0;
+static int running = 0;  // A callback that idles must not re-enter
+
+static void timer_irq(int irq) {
+    (void)irq;
+    ticks++;
+}
+
+void timer_init(void) {
+    uint32_t divisor = PIT_BASE_HZ / TIMER_HZ;
+
+    // Channel 0, lobyte/hibyte, mode 3 (square wave)
+    outb(PIT_COMMAND, 0x36);
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+
+    if (irq_install_handler(0, timer_irq) == 0) {
+        pic_unmask(0);
+    }
+}
+
+uint64_t timer_ms(void) {
+    return ticks * 1000 / TIMER_HZ;
+}
+
+int timer_register(timer_fn fn, uint32_t interval_ms) {
+    if (!fn || callback_count >= TIMER_MAX_CALLBACKS) return -1;
+
+    struct timer_callback *cb = &callbacks[callback_count];
+    cb->fn = fn;
+    cb->interval_ms = interval_ms;
+    cb->due_ms = timer_ms() + interval_ms;
+    return callback_count++;
+}
+
+void timer_set_interval(int handle, uint32_t interval_ms) {
+    if (handle < 0 || handle >= callback_count) return;
+    callbacks[handle].interval_ms = interval_ms;
+    callbacks[handle].due_ms = timer_ms() + interval_ms;
+}
+
+void timer_run_pending(void) {
+    if (running) return;
+    running = 1;
+
+    uint64_t now = timer_ms();
+    for (int i = 0; i < callback_count; i++) {
+        struct timer_callback *cb = &callbacks[i];
+        if (cb->interval_ms == 0 || now < cb->due_ms) continue;
+
+        // Schedule from now so a slow callback does not run back to back
+        cb->fn();
+        now = timer_ms();
+        cb->due_ms = now + cb->interval_ms;
+    }
+
+    running = 0;
+}
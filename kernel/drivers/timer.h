@@ -0,0 +1,37 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// PIT channel 0 ports
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+#define PIT_BASE_HZ  1193182
+
+// Tick rate of the system timer
+#ifndef TIMER_HZ
+#define TIMER_HZ 100
+#endif
+
+// Periodic callbacks that can be registered
+#define TIMER_MAX_CALLBACKS 8
+
+// Program the PIT for TIMER_HZ and start counting ticks on IRQ0
+void timer_init(void);
+
+// Milliseconds since timer_init
+uint64_t timer_ms(void);
+
+// Call fn about every interval_ms. Callbacks never run in interrupt
+// context: they are run by timer_run_pending, from idle loops, so they may
+// wait for disk I/O. Returns a handle for timer_set_interval, or -1.
+typedef void (*timer_fn)(void);
+int timer_register(timer_fn fn, uint32_t interval_ms);
+
+// Change a callback's interval; 0 stops it
+void timer_set_interval(int handle, uint32_t interval_ms);
+
+// Run callbacks that are due. Call when there is nothing else to do.
+void timer_run_pending(void);
+
+#endif
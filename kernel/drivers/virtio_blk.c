@@ -0,0 +1,344 @@
+#include "virtio_blk.h"
+#include "pci.h"
+#include "../heap.h"
+#include "../idt.h"
+#include "../isr.h"
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ volatile ("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outw(uint16_t port, uint16_t val) {
+    __asm__ volatile ("outw %0, %1" : : "a"(val), "Nd"(port) : "memory");
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    __asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port) : "memory");
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// Disable interrupts, returning the previous flags
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    __asm__ volatile ("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+// Per-disk state. Each in-flight virtio request uses a fixed triple of
+// descriptors (header, data, status), so the ring holds queue_size / 3
+// requests. Submitted requests wait in a FIFO until commit moves them onto
+// the ring; the FIFO head may be split over several virtio requests, and a
+// flush at the head holds back the FIFO until the ring has drained.
+struct virtio_disk {
+    uint16_t io;              // Legacy register base (BAR0)
+    uint8_t irq;
+    int read_only;
+    int flush;                // Negotiated VIRTIO_BLK_F_FLUSH
+
+    uint16_t queue_size;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    volatile struct vring_used *used;
+    uint16_t last_used;       // Next used ring entry to reap
+
+    uint16_t slots;           // Requests the ring can hold
+    uint16_t free_count;
+    uint16_t *free_slots;     // Stack of unused slot numbers
+    struct virtio_blk_req_hdr *hdrs;
+    volatile uint8_t *status;
+    struct blk_request **slot_req;
+
+    struct blk_request *queue_head;
+    struct blk_request *queue_tail;
+    uint64_t head_lba;        // Next sector of the queue head to issue
+    uint32_t head_left;       // Sectors of the queue head not yet issued
+    uint8_t *head_pos;
+
+    struct blockdev blockdev;
+};
+
+static struct virtio_disk disks[VIRTIO_BLK_MAX_DISKS];
+static int disk_count = 0;
+
+static void virtio_complete(struct blk_request *req) {
+    req->done = 1;
+    if (req->callback) {
+        req->callback(req);
+    }
+}
+
+static void virtio_pop_head(struct virtio_disk *d) {
+    struct blk_request *req = d->queue_head;
+    d->queue_head = req->next;
+    if (!d->queue_head) d->queue_tail = 0;
+    req->next = 0;
+
+    if (d->queue_head) {
+        d->head_lba = d->queue_head->lba;
+        d->head_left = d->queue_head->count;
+        d->head_pos = (uint8_t *)d->queue_head->buffer;
+    }
+}
+
+// Move queued requests onto the ring and notify the device once for the batch
+static void virtio_kick(struct virtio_disk *d) {
+    uint16_t added = 0;
+
+    while (d->queue_head && d->free_count > 0) {
+        struct blk_request *req = d->queue_head;
+
+        // The device may finish requests in any order, so a flush waits at
+        // the head until everything ahead of it is done. Without a
+        // negotiated write cache those writes are already stable.
+        if (req->flush && d->free_count < d->slots) break;
+        if (req->flush && !d->flush) {
+            virtio_pop_head(d);
+            virtio_complete(req);
+            continue;
+        }
+
+        uint16_t slot = d->free_slots[--d->free_count];
+        uint16_t first = slot * 3;
+        uint32_t n = d->head_left > VIRTIO_BLK_CMD_MAX_SECTORS ? VIRTIO_BLK_CMD_MAX_SECTORS : d->head_left;
+
+        if (req->flush) {
+            d->hdrs[slot].type = VIRTIO_BLK_T_FLUSH;
+        } else {
+            d->hdrs[slot].type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        }
+        d->hdrs[slot].reserved = 0;
+        d->hdrs[slot].sector = req->flush ? 0 : d->head_lba;
+        d->status[slot] = 0xFF;
+
+        // A flush has no data; the header chains straight to the status byte
+        d->desc[first].addr = (uint64_t)(uintptr_t)&d->hdrs[slot];
+        d->desc[first].len = sizeof(struct virtio_blk_req_hdr);
+        d->desc[first].flags = VRING_DESC_F_NEXT;
+        d->desc[first].next = req->flush ? first + 2 : first + 1;
+
+        d->desc[first + 1].addr = (uint64_t)(uintptr_t)d->head_pos;
+        d->desc[first + 1].len = n * 512;
+        d->desc[first + 1].flags = VRING_DESC_F_NEXT | (req->write ? 0 : VRING_DESC_F_WRITE);
+        d->desc[first + 1].next = first + 2;
+
+        d->desc[first + 2].addr = (uint64_t)(uintptr_t)&d->status[slot];
+        d->desc[first + 2].len = 1;
+        d->desc[first + 2].flags = VRING_DESC_F_WRITE;
+        d->desc[first + 2].next = 0;
+
+        d->avail->ring[(uint16_t)(d->avail->idx + added) % d->queue_size] = first;
+        added++;
+
+        d->slot_req[slot] = req;
+        req->pending++;
+
+        d->head_lba += n;
+        d->head_pos += n * 512;
+        d->head_left -= n;
+        if (d->head_left == 0) {
+            virtio_pop_head(d);
+        }
+    }
+
+    if (added == 0) return;
+
+    // Descriptors must be visible before the index, and the index before
+    // we look at whether the device wants a notification
+    __asm__ volatile ("" : : : "memory");
+    d->avail->idx += added;
+    __asm__ volatile ("mfence" : : : "memory");
+
+    if (!(d->used->flags & VRING_USED_F_NO_NOTIFY)) {
+        outw(d->io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    }
+}
+
+// Reap finished requests from the used ring
+static void virtio_service(struct virtio_disk *d) {
+    while (d->last_used != d->used->idx) {
+        __asm__ volatile ("" : : : "memory");
+        volatile struct vring_used_elem *elem = &d->used->ring[d->last_used % d->queue_size];
+        uint16_t slot = elem->id / 3;
+        d->last_used++;
+
+        struct blk_request *req = d->slot_req[slot];
+        uint8_t status = d->status[slot];
+        d->slot_req[slot] = 0;
+        d->free_slots[d->free_count++] = slot;
+        if (!req) continue;
+
+        if (status != VIRTIO_BLK_S_OK) req->status = -1;
+        req->pending--;
+        if (req->pending == 0 && req != d->queue_head) {
+            virtio_complete(req);
+        }
+    }
+
+    // Slots freed up: start whatever was waiting for them. Plugging holds
+    // requests back in the elevator, never here, so this runs regardless.
+    virtio_kick(d);
+}
+
+static void virtio_irq(int irq) {
+    for (int i = 0; i < disk_count; i++) {
+        struct virtio_disk *d = &disks[i];
+        if (d->irq != irq) continue;
+
+        // Reading the ISR status acknowledges the interrupt
+        if (inb(d->io + VIRTIO_REG_ISR_STATUS) & 0x01) {
+            virtio_service(d);
+        }
+    }
+}
+
+static void virtio_poll(struct blockdev *dev) {
+    uint64_t flags = irq_save();
+    virtio_service((struct virtio_disk *)dev->private_data);
+    irq_restore(flags);
+}
+
+static int virtio_submit(struct blockdev *dev, struct blk_request *req) {
+    struct virtio_disk *d = (struct virtio_disk *)dev->private_data;
+    if (req->write && d->read_only) return -1;
+
+    uint64_t flags = irq_save();
+    if (d->queue_tail) {
+        d->queue_tail->next = req;
+    } else {
+        d->queue_head = req;
+        d->head_lba = req->lba;
+        d->head_left = req->count;
+        d->head_pos = (uint8_t *)req->buffer;
+    }
+    d->queue_tail = req;
+    irq_restore(flags);
+
+    return 0;
+}
+
+static void virtio_commit(struct blockdev *dev) {
+    uint64_t flags = irq_save();
+    virtio_kick((struct virtio_disk *)dev->private_data);
+    irq_restore(flags);
+}
+
+// Set up virtqueue 0 in the legacy layout. Returns 0 on success.
+static int virtio_setup_queue(struct virtio_disk *d) {
+    outw(d->io + VIRTIO_REG_QUEUE_SELECT, 0);
+    uint16_t size = inw(d->io + VIRTIO_REG_QUEUE_SIZE);
+    if (size == 0 || size > VIRTIO_QUEUE_MAX) return -1;
+
+    uint32_t avail_end = sizeof(struct vring_desc) * size + sizeof(uint16_t) * (3 + size);
+    uint32_t used_off = (avail_end + VIRTIO_QUEUE_ALIGN - 1) & ~(VIRTIO_QUEUE_ALIGN - 1);
+    uint32_t used_size = sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * size;
+
+    uint8_t *ring = kmalloc_aligned(used_off + used_size, VIRTIO_QUEUE_ALIGN);
+    if (!ring) return -1;
+
+    d->queue_size = size;
+    d->desc = (struct vring_desc *)ring;
+    d->avail = (struct vring_avail *)(ring + sizeof(struct vring_desc) * size);
+    d->used = (volatile struct vring_used *)(ring + used_off);
+    d->last_used = 0;
+
+    d->slots = size / 3;
+    d->free_slots = kmalloc(sizeof(uint16_t) * d->slots);
+    d->hdrs = kmalloc_aligned(sizeof(struct virtio_blk_req_hdr) * d->slots, 16);
+    d->status = kmalloc(d->slots);
+    d->slot_req = kmalloc(sizeof(struct blk_request *) * d->slots);
+    if (!d->free_slots || !d->hdrs || !d->status || !d->slot_req) return -1;
+
+    for (uint16_t i = 0; i < d->slots; i++) {
+        d->free_slots[i] = d->slots - 1 - i;
+    }
+    d->free_count = d->slots;
+
+    outl(d->io + VIRTIO_REG_QUEUE_ADDRESS, (uint32_t)((uintptr_t)ring / 4096));
+    return 0;
+}
+
+static int virtio_disk_init(struct virtio_disk *d, struct pci_device *pdev) {
+    if (!(pdev->bar[0] & 0x01)) return -1;  // Legacy interface lives in an I/O BAR
+
+    pci_enable(pdev, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+    d->io = pdev->bar[0] & 0xFFFC;
+    d->irq = pdev->irq_line;
+
+    // Reset, then announce ourselves
+    outb(d->io + VIRTIO_REG_DEVICE_STATUS, 0);
+    outb(d->io + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(d->io + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    // Only take the flush command; note whether the disk is read-only
+    uint32_t features = inl(d->io + VIRTIO_REG_DEVICE_FEATURES);
+    d->read_only = (features >> VIRTIO_BLK_F_RO) & 1;
+    d->flush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
+    outl(d->io + VIRTIO_REG_GUEST_FEATURES, features & (1u << VIRTIO_BLK_F_FLUSH));
+
+    if (virtio_setup_queue(d) != 0) {
+        outb(d->io + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    struct blockdev *dev = &d->blockdev;
+    dev->sector_size = 512;
+    dev->capacity = (uint64_t)inl(d->io + VIRTIO_REG_CONFIG) |
+                    ((uint64_t)inl(d->io + VIRTIO_REG_CONFIG + 4) << 32);
+    dev->submit = virtio_submit;
+    dev->commit = virtio_commit;
+    dev->private_data = d;
+
+    outb(d->io + VIRTIO_REG_DEVICE_STATUS,
+         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return 0;
+}
+
+int virtio_blk_init(void) {
+    struct pci_device pdev;
+
+    for (int i = 0; disk_count < VIRTIO_BLK_MAX_DISKS &&
+                    pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, i, &pdev) == 0; i++) {
+        struct virtio_disk *d = &disks[disk_count];
+        if (virtio_disk_init(d, &pdev) != 0) continue;
+
+        struct blockdev *dev = &d->blockdev;
+        dev->name[0] = 'v';
+        dev->name[1] = 'd';
+        dev->name[2] = 'a' + disk_count;
+        dev->name[3] = 0;
+
+        // Use the legacy interrupt line if the firmware routed one, else poll
+        if (d->irq > 0 && d->irq < 16 && irq_install_handler(d->irq, virtio_irq) == 0) {
+            dev->poll = 0;
+            pic_unmask(d->irq);
+        } else {
+            dev->poll = virtio_poll;
+        }
+
+        blockdev_register(dev);
+        disk_count++;
+    }
+
+    return disk_count;
+}
@@ -0,0 +1,84 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+// PCI identification (transitional device, legacy I/O interface)
+#define VIRTIO_VENDOR_ID      0x1AF4
+#define VIRTIO_BLK_DEVICE_ID  0x1001
+
+// Legacy virtio PCI registers (offsets from BAR0, an I/O BAR)
+#define VIRTIO_REG_DEVICE_FEATURES 0x00
+#define VIRTIO_REG_GUEST_FEATURES  0x04
+#define VIRTIO_REG_QUEUE_ADDRESS   0x08  // Page frame number of the ring
+#define VIRTIO_REG_QUEUE_SIZE      0x0C
+#define VIRTIO_REG_QUEUE_SELECT    0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY    0x10
+#define VIRTIO_REG_DEVICE_STATUS   0x12
+#define VIRTIO_REG_ISR_STATUS      0x13
+#define VIRTIO_REG_CONFIG          0x14  // virtio-blk: capacity (u64, sectors)
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+// virtio-blk feature bits
+#define VIRTIO_BLK_F_RO    5
+#define VIRTIO_BLK_F_FLUSH 9   // Volatile write cache, flushed with T_FLUSH
+
+// Limits
+#define VIRTIO_BLK_MAX_DISKS       4
+#define VIRTIO_QUEUE_MAX           256    // Largest ring we allocate for
+#define VIRTIO_QUEUE_ALIGN         4096   // Legacy used-ring alignment
+#define VIRTIO_BLK_CMD_MAX_SECTORS 1024   // Sectors per virtio request
+
+// Split virtqueue layout
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2  // Device writes into this buffer
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed));
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed));
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[];
+} __attribute__((packed));
+
+#define VRING_USED_F_NO_NOTIFY 1
+
+// Request header placed in front of the data
+struct virtio_blk_req_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed));
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK  0
+
+// Find legacy virtio-blk PCI devices and register them (vda, vdb, ...) as
+// block devices. Returns the number of disks found.
+int virtio_blk_init(void);
+
+#endif
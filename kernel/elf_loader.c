@@ -1,4 +1,5 @@
 #include "elf_loader.h"
+#include "heap.h"
 
 // Minimal ELF64 loader for VANTA OS.
 // Assumptions:
@@ -71,10 +72,12 @@ typedef struct {
 
 #define PT_LOAD 1
 
-// Loader workspace: a fixed 512 KB staging buffer in .bss to read the file
-// before mapping segments. This limits executable size accordingly.
+// Loader workspace: the file is mapped with vfs_mmap and segments are copied
+// straight out of the page cache. Without a page cache it is read into a
+// 512 KB staging buffer instead, which limits executable size. The buffer
+// comes from the kernel heap on first use; it would not fit in low memory.
 #define ELF_MAX_SIZE (512 * 1024)
-static uint8_t elf_file_buf[ELF_MAX_SIZE];
+static uint8_t *elf_file_buf;
 
 // Execution stack for loaded program (16 KB)
 static uint8_t elf_stack[16 * 1024] __attribute__((aligned(16)));
@@ -86,7 +89,7 @@ extern void print_int(int n);
 static void print_str(const char *s) { mt_print(s); }
 
 // Validate ELF header
-static int validate_header(const Elf64_Ehdr *eh) {
+static int validate_header(const Elf64_Ehdr *eh, uint32_t size) {
     if (eh->e_ident[EI_MAG0] != ELFMAG0 ||
         eh->e_ident[EI_MAG1] != ELFMAG1 ||
         eh->e_ident[EI_MAG2] != ELFMAG2 ||
@@ -97,13 +100,24 @@ static int validate_header(const Elf64_Ehdr *eh) {
     if (eh->e_ident[EI_DATA] != ELFDATA2LSB) return -3; // Not little endian
     if (eh->e_type != ET_EXEC) return -4; // Only ET_EXEC
     if (eh->e_machine != EM_X86_64) return -5; // Wrong arch
+
+    // Program header table must lie inside the file
+    if (eh->e_phnum && eh->e_phentsize < sizeof(Elf64_Phdr)) return -6;
+    uint64_t table = (uint64_t)eh->e_phnum * eh->e_phentsize;
+    if (eh->e_phoff > size || table > size - eh->e_phoff) return -6;
     return 0;
 }
 
-// Load PT_LOAD segments into memory
-static int load_segments(const Elf64_Ehdr *eh) {
-    const uint8_t *base = (const uint8_t *)eh;
-    const uint8_t *ph_base = base + eh->e_phoff;
+// Load PT_LOAD segments into memory. Every segment's file range is checked
+// before anything is copied.
+static int load_segments(const Elf64_Ehdr *eh, const uint8_t *image, uint32_t size) {
+    const uint8_t *ph_base = image + eh->e_phoff;
+
+    for (uint16_t i = 0; i < eh->e_phnum; i++) {
+        const Elf64_Phdr *ph = (const Elf64_Phdr *)(ph_base + i * eh->e_phentsize);
+        if (ph->p_type != PT_LOAD) continue;
+        if (ph->p_offset > size || ph->p_filesz > size - ph->p_offset) return -7;
+    }
 
     for (uint16_t i = 0; i < eh->e_phnum; i++) {
         const Elf64_Phdr *ph = (const Elf64_Phdr *)(ph_base + i * eh->e_phentsize);
@@ -111,7 +125,7 @@ static int load_segments(const Elf64_Ehdr *eh) {
 
         // We treat p_paddr as the destination (flat physical address).
         uint8_t *dst = (uint8_t *)(uintptr_t)ph->p_paddr;
-        const uint8_t *src = base + ph->p_offset;
+        const uint8_t *src = image + ph->p_offset;
 
         // Copy file-backed portion
         if (ph->p_filesz > 0) {
@@ -127,6 +141,15 @@ static int load_segments(const Elf64_Ehdr *eh) {
     return 0;
 }
 
+// Check and load the image; 0 with the entry point, or an error code
+static int load_image(const uint8_t *image, uint32_t size, uint64_t *entry) {
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)image;
+    int rc = validate_header(eh, size);
+    if (rc == 0) rc = load_segments(eh, image, size);
+    if (rc == 0) *entry = eh->e_entry;
+    return rc;
+}
+
 // Execute loaded image: create a function pointer to entry and call it.
 static int jump_to_entry(uint64_t entry, char **args) {
     // Prepare stack: place argv pointer array and a null terminator.
@@ -152,27 +175,49 @@ int elf_execute(struct vfs_node *node, char **args) {
     (void)args; // args unused for now
     if (!node || !(node->flags & VFS_FILE)) return -10;
 
-    if (node->size > ELF_MAX_SIZE) {
-        print_str("exec: file too large\n");
-        return -11;
+    if (node->size < sizeof(Elf64_Ehdr)) {
+        print_str("exec: invalid ELF\n");
+        return -1;
     }
 
-    int read = vfs_read(node, 0, node->size, elf_file_buf);
-    if (read < 0 || (uint32_t)read < node->size) {
-        print_str("exec: read failed\n");
-        return -12;
+    const uint8_t *image = (const uint8_t *)vfs_mmap(node, 0, node->size);
+    int mapped = image != 0;
+    if (!mapped) {
+        if (node->size > ELF_MAX_SIZE) {
+            print_str("exec: file too large\n");
+            return -11;
+        }
+        if (!elf_file_buf) elf_file_buf = kmalloc(ELF_MAX_SIZE);
+        if (!elf_file_buf) {
+            print_str("exec: out of memory\n");
+            return -13;
+        }
+
+        int read = vfs_read(node, 0, node->size, elf_file_buf);
+        if (read < 0 || (uint32_t)read < node->size) {
+            print_str("exec: read failed\n");
+            return -12;
+        }
+        image = elf_file_buf;
     }
 
-    Elf64_Ehdr *eh = (Elf64_Ehdr *)elf_file_buf;
-    int hv = validate_header(eh);
-    if (hv != 0) {
+    // Through a mapping, pages are faulted in as the header and segments are
+    // read. A page that could not be read shows up as zeroes, so a failed
+    // unmap overrides whatever the checks made of it.
+    uint64_t entry = 0;
+    int rc = load_image(image, node->size, &entry);
+    if (mapped && vfs_munmap((void *)image) != 0) rc = -12;
+    if (rc == -12) {
+        print_str("exec: read failed\n");
+        return rc;
+    }
+    if (rc != 0) {
         print_str("exec: invalid ELF\n");
-        print_int(hv);
+        print_int(rc);
         print_str("\n");
-        return hv;
+        return rc;
     }
 
-    load_segments(eh);
-    int ret = jump_to_entry(eh->e_entry, args);
+    int ret = jump_to_entry(entry, args);
     return ret;
 }
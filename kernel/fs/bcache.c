@@ -0,0 +1,259 @@
+#include "bcache.h"
+#include "../heap.h"
+
+// Buffers hang off a hash table for lookup and off an LRU list for
+// eviction. Referenced or dirty buffers stay on the list; eviction takes
+// the least recently used one that is unreferenced, writing it back first
+// if it is dirty.
+static struct bcache_buf *bufs = 0;
+static uint32_t buf_count = 0;
+static struct bcache_buf **hash_table = 0;
+static uint32_t hash_size = 0;  // Power of two
+static struct bcache_buf *lru_head = 0;  // Most recently used
+static struct bcache_buf *lru_tail = 0;  // Least recently used
+static uint32_t dirty_count = 0;
+static int evicted_dirty = 0;  // Eviction had to write back since the last sync
+
+static uint32_t bcache_hash(struct blockdev *dev, uint64_t lba) {
+    uint64_t key = lba ^ ((uint64_t)(uintptr_t)dev >> 4);
+    key ^= key >> 17;
+    return (uint32_t)key & (hash_size - 1);
+}
+
+static void lru_unlink(struct bcache_buf *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_prev = 0;
+    b->lru_next = 0;
+}
+
+static void lru_push_front(struct bcache_buf *b) {
+    b->lru_prev = 0;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    lru_head = b;
+    if (!lru_tail) lru_tail = b;
+}
+
+static void hash_remove(struct bcache_buf *b) {
+    struct bcache_buf **link = &hash_table[bcache_hash(b->dev, b->lba)];
+    while (*link) {
+        if (*link == b) {
+            *link = b->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    b->hash_next = 0;
+}
+
+static struct bcache_buf *hash_lookup(struct blockdev *dev, uint64_t lba) {
+    struct bcache_buf *b = hash_table[bcache_hash(dev, lba)];
+    while (b) {
+        if (b->dev == dev && b->lba == lba) return b;
+        b = b->hash_next;
+    }
+    return 0;
+}
+
+int bcache_init(uint32_t buffers) {
+    if (buffers == 0) return -1;
+
+    hash_size = 1;
+    while (hash_size < buffers) hash_size <<= 1;
+
+    bufs = kmalloc(sizeof(struct bcache_buf) * buffers);
+    hash_table = kmalloc(sizeof(struct bcache_buf *) * hash_size);
+    uint8_t *data = kmalloc_aligned(BCACHE_SECTOR_SIZE * buffers, BCACHE_SECTOR_SIZE);
+    if (!bufs || !hash_table || !data) {
+        buf_count = 0;
+        return -1;
+    }
+
+    buf_count = buffers;
+    for (uint32_t i = 0; i < buffers; i++) {
+        bufs[i].data = data + i * BCACHE_SECTOR_SIZE;
+        lru_push_front(&bufs[i]);
+    }
+    return 0;
+}
+
+// Pick the least recently used free buffer, cleaning it if allowed to
+static struct bcache_buf *bcache_evict(int write_back) {
+    for (struct bcache_buf *b = lru_tail; b; b = b->lru_prev) {
+        if (b->refcount > 0 || (b->flags & BCACHE_BUSY)) continue;
+
+        if (b->flags & BCACHE_DIRTY) {
+            if (!write_back) continue;
+            if (blockdev_write(b->dev, b->lba, 1, b->data) != 0) continue;
+            b->flags &= ~BCACHE_DIRTY;
+            dirty_count--;
+            evicted_dirty = 1;
+        }
+
+        if (b->dev) hash_remove(b);
+        return b;
+    }
+    return 0;
+}
+
+static void bcache_assign(struct bcache_buf *b, struct blockdev *dev, uint64_t lba) {
+    b->dev = dev;
+    b->lba = lba;
+    b->flags = 0;
+    uint32_t h = bcache_hash(dev, lba);
+    b->hash_next = hash_table[h];
+    hash_table[h] = b;
+}
+
+static void bcache_read_done(struct blk_request *req) {
+    struct bcache_buf *b = (struct bcache_buf *)req->ctx;
+    if (req->status == 0) b->flags |= BCACHE_VALID;
+    b->flags &= ~BCACHE_BUSY;
+}
+
+int bcache_prefetch(struct blockdev *dev, uint64_t lba, uint32_t count) {
+    if (buf_count == 0) return -1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (hash_lookup(dev, lba + i)) continue;  // Cached or already on its way
+
+        // Never stall read-ahead on a write-back
+        struct bcache_buf *b = bcache_evict(0);
+        if (!b) return -1;
+        bcache_assign(b, dev, lba + i);
+        lru_unlink(b);
+        lru_push_front(b);
+
+        b->flags = BCACHE_BUSY;
+        b->req.lba = lba + i;
+        b->req.count = 1;
+        b->req.buffer = b->data;
+        b->req.write = 0;
+        b->req.flush = 0;
+        b->req.callback = bcache_read_done;
+        b->req.ctx = b;
+        if (blockdev_submit(dev, &b->req) != 0) {
+            b->flags = 0;
+        }
+    }
+    return 0;
+}
+
+struct bcache_buf *bcache_get(struct blockdev *dev, uint64_t lba) {
+    if (buf_count == 0) return 0;
+
+    struct bcache_buf *b = hash_lookup(dev, lba);
+    if (!b) {
+        b = bcache_evict(1);
+        if (!b) return 0;
+        bcache_assign(b, dev, lba);
+    }
+
+    b->refcount++;
+    lru_unlink(b);
+    lru_push_front(b);
+
+    // A read-ahead into this buffer must land before anyone uses it
+    if (b->flags & BCACHE_BUSY) {
+        blockdev_wait(dev, &b->req);
+    }
+    return b;
+}
+
+struct bcache_buf *bcache_read(struct blockdev *dev, uint64_t lba) {
+    struct bcache_buf *b = bcache_get(dev, lba);
+    if (!b) return 0;
+
+    if (!(b->flags & BCACHE_VALID)) {
+        if (blockdev_read(dev, lba, 1, b->data) != 0) {
+            bcache_release(b);
+            return 0;
+        }
+        b->flags |= BCACHE_VALID;
+    }
+    return b;
+}
+
+void bcache_overlay(struct blockdev *dev, uint64_t lba, uint32_t count, void *buffer) {
+    if (buf_count == 0 || dirty_count == 0) return;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct bcache_buf *b = hash_lookup(dev, lba + i);
+        if (!b || !(b->flags & BCACHE_DIRTY)) continue;
+
+        uint8_t *dst = (uint8_t *)buffer + i * BCACHE_SECTOR_SIZE;
+        for (uint32_t j = 0; j < BCACHE_SECTOR_SIZE; j++) dst[j] = b->data[j];
+    }
+}
+
+void bcache_release(struct bcache_buf *buf) {
+    if (buf && buf->refcount > 0) {
+        buf->refcount--;
+    }
+}
+
+void bcache_mark_dirty(struct bcache_buf *buf) {
+    if (!(buf->flags & BCACHE_DIRTY)) dirty_count++;
+    buf->flags |= BCACHE_VALID | BCACHE_DIRTY;
+}
+
+uint32_t bcache_dirty_count(void) {
+    return dirty_count;
+}
+
+int bcache_under_pressure(void) {
+    return evicted_dirty || dirty_count * 100 > buf_count * BCACHE_DIRTY_PERCENT;
+}
+
+int bcache_sync(struct blockdev *dev) {
+    int result = 0;
+
+    if (!dev) {
+        for (int i = 0; i < blockdev_count(); i++) {
+            if (bcache_sync(blockdev_get(i)) != 0) result = -1;
+        }
+        return result;
+    }
+
+    // Queue every dirty sector of the device, then let the elevator turn
+    // neighbouring sectors into a few large writes
+    int written = 0;
+    blockdev_plug(dev);
+    for (uint32_t i = 0; i < buf_count; i++) {
+        struct bcache_buf *b = &bufs[i];
+        if (b->dev != dev || !(b->flags & BCACHE_DIRTY)) continue;
+
+        b->req.lba = b->lba;
+        b->req.count = 1;
+        b->req.buffer = b->data;
+        b->req.write = 1;
+        b->req.flush = 0;
+        b->req.callback = 0;
+        b->req.ctx = b;
+        if (blockdev_submit(dev, &b->req) != 0) {
+            b->req.done = 1;
+            b->req.status = -1;
+        }
+        written++;
+    }
+    blockdev_unplug(dev);
+
+    for (uint32_t i = 0; i < buf_count; i++) {
+        struct bcache_buf *b = &bufs[i];
+        if (b->dev != dev || !(b->flags & BCACHE_DIRTY)) continue;
+
+        if (blockdev_wait(dev, &b->req) == 0) {
+            b->flags &= ~BCACHE_DIRTY;
+            dirty_count--;
+        } else {
+            result = -1;
+        }
+    }
+
+    if (written && blockdev_flush(dev) != 0) result = -1;
+    if (result == 0) evicted_dirty = 0;
+    return result;
+}
@@ -0,0 +1,75 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "../drivers/blockdev.h"
+
+// Default number of cached sectors (512 bytes each)
+#ifndef BCACHE_DEFAULT_BUFFERS
+#define BCACHE_DEFAULT_BUFFERS 1024
+#endif
+
+// Share of the cache that may be dirty before bcache_under_pressure says so
+#ifndef BCACHE_DIRTY_PERCENT
+#define BCACHE_DIRTY_PERCENT 50
+#endif
+
+#define BCACHE_SECTOR_SIZE 512
+
+// Buffer flags
+#define BCACHE_VALID 0x01  // data holds the sector's contents
+#define BCACHE_DIRTY 0x02  // data is newer than the disk
+#define BCACHE_BUSY  0x04  // Read-ahead in flight
+
+// One cached sector, keyed by (dev, lba)
+struct bcache_buf {
+    struct blockdev *dev;
+    uint64_t lba;
+    uint8_t *data;
+    uint32_t refcount;
+    volatile uint8_t flags;
+
+    struct bcache_buf *hash_next;
+    struct bcache_buf *lru_prev;  // Toward the most recently used
+    struct bcache_buf *lru_next;  // Toward the least recently used
+    struct blk_request req;       // Used for read-ahead and write-back
+};
+
+// Allocate the cache. Returns 0 on success.
+int bcache_init(uint32_t buffers);
+
+// Referenced buffer for a sector, read from disk if not cached. Returns 0
+// on I/O error or when every buffer is in use.
+struct bcache_buf *bcache_read(struct blockdev *dev, uint64_t lba);
+
+// Referenced buffer for a sector without reading it. Meant for callers that
+// overwrite the whole sector; check BCACHE_VALID before relying on data.
+struct bcache_buf *bcache_get(struct blockdev *dev, uint64_t lba);
+
+void bcache_release(struct bcache_buf *buf);
+
+// Start reading sectors that are not cached yet without waiting for them.
+// Only clean, idle buffers are recycled. Call with the device plugged so the
+// reads merge. Returns -1 once no buffer is left to read into.
+int bcache_prefetch(struct blockdev *dev, uint64_t lba, uint32_t count);
+
+// Copy the cached dirty sectors among count sectors from lba over buffer,
+// after the range was read from disk without going through the cache
+void bcache_overlay(struct blockdev *dev, uint64_t lba, uint32_t count, void *buffer);
+
+// The caller changed data; it is written back by bcache_sync
+void bcache_mark_dirty(struct bcache_buf *buf);
+
+// Dirty buffers across all devices
+uint32_t bcache_dirty_count(void);
+
+// Nonzero once more than BCACHE_DIRTY_PERCENT of the cache is dirty, or a
+// buffer had to be written back to make room. Owners of dirty state should
+// then sync instead of waiting for their timer.
+int bcache_under_pressure(void);
+
+// Write back every dirty buffer of dev (all devices if 0) and flush the
+// drives' caches. Returns 0 on success.
+int bcache_sync(struct blockdev *dev);
+
+#endif
@@ -1,19 +1,137 @@
 #include "fat32.h"
-#include "../drivers/ata.h"
+#include "bcache.h"
+#include "../heap.h"
+#include "../drivers/timer.h"
 
 // Filesystem state
 static struct fat32_fs fs;
+static int writeback_timer = -1;
 static struct vfs_node root_node;
 static uint8_t sector_buffer[512];
-static uint8_t cluster_buffer[4096];  // Max 4KB cluster
 
 // Directory entry buffer
 static struct dirent dirent_buf;
 
-// Node cache (simple, fixed size)
-#define NODE_CACHE_SIZE 32
-static struct vfs_node node_cache[NODE_CACHE_SIZE];
-static int node_cache_used = 0;
+// FAT cache: a fixed pool of FAT32_FAT_CACHE_SECTORS sectors of the active
+// FAT, hashed by sector and kept in LRU order. Updates only mark pages
+// dirty; fat_flush writes them to every FAT copy in one batch. A miss
+// recycles the least recently used clean page, flushing first if every
+// page is dirty.
+#define FAT_LOAD_BATCH  8   // Sectors read together on a miss
+#define FAT_FLUSH_BATCH 32  // Writes in flight while flushing
+#define FAT_HASH_SIZE   256 // Power of two
+struct fat_page {
+    uint32_t sector;
+    int used;
+    int dirty;
+    uint8_t *data;
+    struct fat_page *hash_next;
+    struct fat_page *lru_prev;  // Toward the most recently used
+    struct fat_page *lru_next;  // Toward the least recently used
+};
+static struct fat_page *fat_pages;
+static struct fat_page *fat_hash[FAT_HASH_SIZE];
+static struct fat_page *fat_lru_head = 0;
+static struct fat_page *fat_lru_tail = 0;
+static uint32_t fat_dirty_count = 0;
+static uint8_t fat_scratch[FAT_LOAD_BATCH * 512];  // Misses are read here, then copied
+
+// What get_next_cluster returns when the FAT sector cannot be read. It is
+// above every end-of-chain mark, so callers must test for it first.
+#define FAT_READ_ERROR 0xFFFFFFFF
+
+// Free-cluster bitmap, one bit per cluster (set = in use). Built from the
+// FAT on the first allocation; afterwards allocations scan it a word at a
+// time from the FSInfo next-free hint.
+static uint32_t *cluster_bitmap;
+static int cluster_bitmap_ready = 0;
+static uint32_t reserved_count = 0;  // Preallocated to files but not linked yet
+
+// A growing file reserves as many clusters again as it already has, within
+// these bounds, right behind its tail. Whatever it has not used when the
+// last reference goes away is given back.
+#define FAT32_PREALLOC_MIN 4
+#define FAT32_PREALLOC_MAX 256
+
+// Directory index: for each indexed directory, every entry's 8.3 name
+// hashed to where the entry lives. A directory is indexed in full on its
+// first lookup, so a miss needs no disk access. Entries come from a shared
+// pool; when it runs dry the least recently used directory is dropped.
+#define DIR_INDEX_DIRS    32    // Directories indexed at once
+#define DIR_INDEX_ENTRIES 4096  // Entries across all of them
+#define DIR_INDEX_BUCKETS 1024  // Power of two
+struct dentry {
+    uint32_t dir;             // First cluster of the directory
+    uint8_t name[11];
+    uint32_t lba;             // Sector holding the entry
+    uint32_t index;           // Entry within that sector
+    struct dentry *hash_next;
+    struct dentry *dir_next;  // Next entry of the same directory
+};
+struct dir_index {
+    uint32_t dir;             // 0 = slot unused
+    uint32_t last_used;
+    struct dentry *entries;
+};
+static struct dir_index dir_indexes[DIR_INDEX_DIRS];
+static struct dentry **dentry_hash;
+static struct dentry *dentry_free;
+static uint32_t dir_index_clock = 0;
+
+// Per-file state: where the directory entry lives, how far to read ahead
+// and an extent map of the cluster chain. The map is built on first seek;
+// a chain with more runs than fit is mapped up to the last extent and
+// walked through the FAT after it.
+#define FAT32_RA_MIN_SECTORS 16
+#define FAT32_RA_MAX_SECTORS 256
+#define FAT32_FILE_EXTENTS   32
+
+// Reads of at least this many aligned sectors bypass the cache and go
+// straight into the caller's buffer, one request per contiguous run
+#define FAT32_DIRECT_MIN_SECTORS 8
+#define FAT32_DIRECT_MAX_SECTORS 2048
+struct fat32_extent {
+    uint32_t file_cluster;  // Position of the run's first cluster in the file
+    uint32_t disk_cluster;
+    uint32_t length;
+};
+struct fat32_file {
+    uint32_t dirent_lba;   // Sector holding the directory entry
+    uint32_t dirent_index; // Entry within that sector
+    uint32_t next_offset;  // Where a sequential read would continue
+    uint32_t window;       // Read-ahead window in sectors (0 = off)
+    uint32_t ra_end;       // File offset read-ahead has been issued up to
+
+    uint32_t prealloc_start;  // Reserved clusters following the tail
+    uint32_t prealloc_count;
+
+    int map_valid;
+    uint32_t chain_gen;      // Bumped when clusters move or go away
+    uint32_t extent_count;
+    uint32_t cluster_count;  // Clusters in the chain
+    uint32_t tail_cluster;   // Last cluster of the chain (0 if empty)
+    struct fat32_extent extents[FAT32_FILE_EXTENTS];
+};
+
+// Vnode cache: one node per file or directory, keyed by where its directory
+// entry lives (the first cluster is 0 for empty files and changes when they
+// grow). Lookups hand out references; nodes nobody holds are recycled least
+// recently used first.
+#define VNODE_CACHE_SIZE 256
+#define VNODE_HASH_SIZE  256  // Power of two
+struct fat32_vnode {
+    struct vfs_node node;     // First, so a vfs_node * is a fat32_vnode *
+    struct fat32_file file;
+    uint32_t refcount;
+    int hashed;
+    struct fat32_vnode *hash_next;
+    struct fat32_vnode *lru_prev;  // Toward the most recently used
+    struct fat32_vnode *lru_next;  // Toward the least recently used
+};
+static struct fat32_vnode *vnodes;
+static struct fat32_vnode *vnode_hash[VNODE_HASH_SIZE];
+static struct fat32_vnode *vnode_lru_head = 0;
+static struct fat32_vnode *vnode_lru_tail = 0;
 
 // String functions
 static int strlen(const char *s) {
@@ -42,68 +160,658 @@ static int strncmp(const char *a, const char *b, int n) {
     return 0;
 }
 
+static void string_to_fat32_name(const char *str, uint8_t *fat_name);
+
+// Directories are walked one sector at a time through the buffer cache
+#define DIR_ENTRIES_PER_SECTOR (512 / sizeof(struct fat32_dir_entry))
+
+// Check if cluster is end of chain
+static int is_end_of_chain(uint32_t cluster) {
+    return cluster >= 0x0FFFFFF8;
+}
+
 // Convert cluster number to LBA
 static uint32_t cluster_to_lba(uint32_t cluster) {
     return fs.cluster_start_lba + (cluster - 2) * fs.sectors_per_cluster;
 }
 
-// Read a cluster
-static int read_cluster(uint32_t cluster, void *buffer) {
-    uint32_t lba = cluster_to_lba(cluster);
-    return ata_read_sectors(lba, fs.sectors_per_cluster, buffer);
+static int fat_flush(void);
+
+static void fat_lru_unlink(struct fat_page *p) {
+    if (p->lru_prev) p->lru_prev->lru_next = p->lru_next;
+    else fat_lru_head = p->lru_next;
+    if (p->lru_next) p->lru_next->lru_prev = p->lru_prev;
+    else fat_lru_tail = p->lru_prev;
+    p->lru_prev = 0;
+    p->lru_next = 0;
 }
 
-static int write_cluster(uint32_t cluster, void *buffer) {
-    uint32_t lba = cluster_to_lba(cluster);
-    return ata_write_sectors(lba, fs.sectors_per_cluster, buffer);
+static void fat_lru_push_front(struct fat_page *p) {
+    p->lru_prev = 0;
+    p->lru_next = fat_lru_head;
+    if (fat_lru_head) fat_lru_head->lru_prev = p;
+    fat_lru_head = p;
+    if (!fat_lru_tail) fat_lru_tail = p;
 }
 
-// Get next cluster from FAT
-static uint32_t get_next_cluster(uint32_t cluster) {
-    uint32_t fat_offset = cluster * 4; // get byte offset
-    uint32_t fat_sector = fs.fat_start_lba + (fat_offset / fs.bytes_per_sector); // find the sector using integer division to round down to the nearest sector
-    uint32_t entry_offset = fat_offset % fs.bytes_per_sector; // use modulo to get the clusters offset in the sector worked out in the previous calculation
+static struct fat_page *fat_lookup(uint32_t sector) {
+    struct fat_page *p = fat_hash[sector & (FAT_HASH_SIZE - 1)];
+    while (p && p->sector != sector) p = p->hash_next;
+    return p;
+}
 
-    ata_read_sectors(fat_sector, 1, sector_buffer);
+static void fat_unhash(struct fat_page *p) {
+    struct fat_page **link = &fat_hash[p->sector & (FAT_HASH_SIZE - 1)];
+    while (*link) {
+        if (*link == p) {
+            *link = p->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    p->hash_next = 0;
+    p->used = 0;
+}
 
-    uint32_t next = *(uint32_t *)(sector_buffer + entry_offset);
-    next &= 0x0FFFFFFF;  // Mask off high 4 bits
+// Least recently used clean page, writing the FAT back if none is clean
+static struct fat_page *fat_evict(void) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (struct fat_page *p = fat_lru_tail; p; p = p->lru_prev) {
+            if (p->dirty) continue;
+            if (p->used) fat_unhash(p);
+            return p;
+        }
+        if (fat_flush() != 0) return 0;
+    }
+    return 0;
+}
 
-    return next;
+// Load a run of uncached FAT sectors starting at sector. They are read
+// into the scratch buffer first, so a failed read claims no pages.
+static int fat_load(uint32_t sector) {
+    uint32_t n = 0;
+    while (n < FAT_LOAD_BATCH && sector + n < fs.fat_size && !fat_lookup(sector + n)) n++;
+
+    if (blockdev_read(fs.dev, fs.fat_start_lba + fs.active_fat * fs.fat_size + sector, n, fat_scratch) != 0) return -1;
+
+    // Insert the wanted sector last so it is the most recently used
+    for (uint32_t i = n; i-- > 0;) {
+        struct fat_page *p = fat_evict();
+        if (!p) return -1;
+        memcpy(p->data, fat_scratch + i * fs.bytes_per_sector, fs.bytes_per_sector);
+        p->sector = sector + i;
+        p->used = 1;
+        p->hash_next = fat_hash[p->sector & (FAT_HASH_SIZE - 1)];
+        fat_hash[p->sector & (FAT_HASH_SIZE - 1)] = p;
+        fat_lru_unlink(p);
+        fat_lru_push_front(p);
+    }
+    return 0;
+}
+
+// Cached FAT page holding a cluster's entry (0 if out of range or unreadable)
+static struct fat_page *fat_page_of(uint32_t cluster) {
+    uint32_t fat_sector = cluster * 4 / fs.bytes_per_sector;
+    if (fat_sector >= fs.fat_size) return 0;
+
+    struct fat_page *p = fat_lookup(fat_sector);
+    if (!p) {
+        if (fat_load(fat_sector) != 0) return 0;
+        p = fat_lookup(fat_sector);
+        if (!p) return 0;
+    }
+    if (p != fat_lru_head) {
+        fat_lru_unlink(p);
+        fat_lru_push_front(p);
+    }
+    return p;
+}
+
+// Cached FAT entry for a cluster (0 if out of range or unreadable). The
+// pointer is only good until the next FAT access.
+static uint32_t *fat_entry(uint32_t cluster) {
+    struct fat_page *p = fat_page_of(cluster);
+    if (!p) return 0;
+    return (uint32_t *)(p->data + cluster * 4 % fs.bytes_per_sector);
+}
+
+// Get next cluster from FAT (FAT_READ_ERROR if the FAT cannot be read)
+static uint32_t get_next_cluster(uint32_t cluster) {
+    uint32_t *entry = fat_entry(cluster);
+    if (!entry) return FAT_READ_ERROR;
+
+    return *entry & 0x0FFFFFFF;  // Mask off high 4 bits
 }
 
 static int set_fat_entry(uint32_t cluster, uint32_t value) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fs.fat_start_lba + (fat_offset / fs.bytes_per_sector);
-    uint32_t entry_offset = fat_offset % fs.bytes_per_sector;
+    struct fat_page *p = fat_page_of(cluster);
+    if (!p) return -1;
 
-    ata_read_sectors(fat_sector, 1, sector_buffer); // read to stop garbage memory in sector_buffer
+    // The top 4 bits are reserved and must be preserved
+    uint32_t *entry = (uint32_t *)(p->data + cluster * 4 % fs.bytes_per_sector);
+    *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
 
-    uint32_t *ptr = (uint32_t *)(sector_buffer + entry_offset); // cast pointer to a 4 byte type at the position of the 4 byte write in terms of the whole disk, not just the cluster
-    *ptr = value; // set 4 byte *ptr to value
+    if (!p->dirty) {
+        p->dirty = 1;
+        fat_dirty_count++;
+    }
+    return 0;
+}
 
-    ata_write_sectors(fat_sector, 1, sector_buffer); // write the sector back to disk
+// Write dirty FAT sectors to every FAT copy, a batch of requests at a time
+static int fat_flush(void) {
+    static struct blk_request reqs[FAT_FLUSH_BATCH];
+    if (fat_dirty_count == 0) return 0;
+
+    int result = 0;
+    uint32_t copies = fs.fat_mirror ? fs.num_fats : 1;
+
+    for (uint32_t copy = 0; copy < copies; copy++) {
+        uint32_t base = fs.fat_start_lba + (fs.fat_mirror ? copy : fs.active_fat) * fs.fat_size;
+        uint32_t i = 0;
+
+        while (i < FAT32_FAT_CACHE_SECTORS) {
+            int n = 0;
+            blockdev_plug(fs.dev);
+            for (; i < FAT32_FAT_CACHE_SECTORS && n < FAT_FLUSH_BATCH; i++) {
+                struct fat_page *p = &fat_pages[i];
+                if (!p->dirty) continue;
+
+                struct blk_request *req = &reqs[n];
+                req->lba = base + p->sector;
+                req->count = 1;
+                req->buffer = p->data;
+                req->write = 1;
+                req->flush = 0;
+                req->callback = 0;
+                req->ctx = 0;
+                if (blockdev_submit(fs.dev, req) != 0) {
+                    result = -1;
+                    continue;
+                }
+                n++;
+            }
+            blockdev_unplug(fs.dev);
+
+            for (int i = 0; i < n; i++) {
+                if (blockdev_wait(fs.dev, &reqs[i]) != 0) result = -1;
+            }
+        }
+    }
 
+    if (result == 0) {
+        for (uint32_t i = 0; i < FAT32_FAT_CACHE_SECTORS; i++) fat_pages[i].dirty = 0;
+        fat_dirty_count = 0;
+        result = blockdev_flush(fs.dev);
+    }
+    return result;
+}
+
+// One past the last data cluster
+static uint32_t cluster_limit(void) {
+    return fs.total_clusters + 2;
+}
+
+static int cluster_used(uint32_t cluster) {
+    return cluster_bitmap[cluster / 32] & (1u << (cluster % 32));
+}
+
+static int cluster_bitmap_build(void) {
+    uint32_t limit = cluster_limit();
+    uint32_t words = (limit + 31) / 32;
+
+    if (!cluster_bitmap) {
+        cluster_bitmap = kmalloc(words * 4);
+        if (!cluster_bitmap) return -1;
+    }
+
+    // Clusters 0 and 1 are reserved; bits past the end are never handed out
+    cluster_bitmap[0] |= 0x3;
+    for (uint32_t c = limit; c < words * 32; c++) {
+        cluster_bitmap[c / 32] |= 1u << (c % 32);
+    }
+
+    uint32_t free = 0;
+    for (uint32_t c = 2; c < limit; c++) {
+        uint32_t *entry = fat_entry(c);
+        if (!entry) return -1;
+        if ((*entry & 0x0FFFFFFF) == 0) free++;
+        else cluster_bitmap[c / 32] |= 1u << (c % 32);
+    }
+
+    // The FAT is authoritative; repair a stale FSInfo count
+    if (fs.free_count != free) {
+        fs.free_count = free;
+        fs.fsinfo_dirty = 1;
+    }
+    cluster_bitmap_ready = 1;
     return 0;
 }
 
-static uint32_t find_free_cluster(){
-    for (int i = 2; i < fs.total_clusters; i++){ 
-        uint32_t entry = get_next_cluster(i);
-        if (entry == 0x00000000){ // check if the cluster is empty
-            return i; 
+// First free cluster at or after from (0 if none)
+static uint32_t cluster_bitmap_find(uint32_t from) {
+    uint32_t words = (cluster_limit() + 31) / 32;
+    for (uint32_t w = from / 32; w < words; w++) {
+        uint32_t bits = cluster_bitmap[w];
+        if (w == from / 32) bits |= (1u << (from % 32)) - 1;  // Ignore clusters before from
+        if (bits != 0xFFFFFFFF) return w * 32 + __builtin_ctz(~bits);
+    }
+    return 0;
+}
+
+// First free run of at least want clusters at or after from, wrapping
+// around once; the longest run seen if none is that long (0 if none at all)
+static uint32_t cluster_bitmap_find_run(uint32_t from, uint32_t want) {
+    uint32_t limit = cluster_limit();
+    uint32_t best = 0;
+    uint32_t best_len = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t c = cluster_bitmap_find(pass ? 2 : from);
+        uint32_t end = pass ? from : limit;
+        while (c && c < end) {
+            uint32_t len = 0;
+            while (len < want && c + len < limit && !cluster_used(c + len)) len++;
+            if (len >= want) return c;
+            if (len > best_len) {
+                best = c;
+                best_len = len;
+            }
+            c = cluster_bitmap_find(c + len);
         }
+        if (from <= 2) break;
+    }
+    return best;
+}
+
+// Claim a run of up to want free clusters, starting the search at hint (a
+// file's tail + 1 keeps it contiguous) or, if 0, at the next-free hint.
+// Returns the first cluster (0 if the volume is full) and the run length in
+// *count. The caller links the FAT entries.
+static uint32_t alloc_clusters(uint32_t hint, uint32_t want, uint32_t *count) {
+    *count = 0;
+    if (want == 0) return 0;
+    if (!cluster_bitmap_ready && cluster_bitmap_build() != 0) return 0;
+    if (fs.free_count == 0) return 0;
+
+    uint32_t limit = cluster_limit();
+    uint32_t start = hint ? hint : fs.next_free;
+    if (start < 2 || start >= limit) start = 2;
+
+    // Carry on right at the hint if it is free, otherwise take the first
+    // run long enough for the whole request (or the longest there is)
+    uint32_t first = hint && !cluster_used(start) ? start : cluster_bitmap_find_run(start, want);
+    if (first == 0) return 0;
+
+    uint32_t n = 0;
+    while (n < want && first + n < limit && !cluster_used(first + n)) {
+        cluster_bitmap[(first + n) / 32] |= 1u << ((first + n) % 32);
+        n++;
+    }
+
+    fs.free_count -= n;
+    fs.next_free = first + n;
+    fs.fsinfo_dirty = 1;
+    *count = n;
+    return first;
+}
+
+static void release_cluster(uint32_t cluster) {
+    if (cluster_bitmap_ready) {
+        cluster_bitmap[cluster / 32] &= ~(1u << (cluster % 32));
+    }
+    if (fs.free_count != FAT32_FSINFO_UNKNOWN) fs.free_count++;
+    fs.fsinfo_dirty = 1;
+}
+
+// Return every cluster of a chain to the free pool
+static int free_chain(uint32_t cluster) {
+    while (cluster >= 2 && cluster < cluster_limit()) {
+        uint32_t next = get_next_cluster(cluster);
+        if (next == FAT_READ_ERROR || set_fat_entry(cluster, 0) != 0) return -1;
+        release_cluster(cluster);
+        cluster = next;
+    }
+    return 0;
+}
+
+// Give a file's unused reservation back to the free pool
+static void prealloc_trim(struct fat32_file *file) {
+    if (file->prealloc_count == 0) return;
+    for (uint32_t i = 0; i < file->prealloc_count; i++) {
+        uint32_t c = file->prealloc_start + i;
+        cluster_bitmap[c / 32] &= ~(1u << (c % 32));
     }
+    fs.free_count += file->prealloc_count;
+    reserved_count -= file->prealloc_count;
+    file->prealloc_count = 0;
+    fs.fsinfo_dirty = 1;
+}
+
+// Store the free count and hint in the FSInfo sector through the cache
+static int fsinfo_update(void) {
+    if (!fs.fsinfo_lba || !fs.fsinfo_dirty) return 0;
+
+    struct bcache_buf *buf = bcache_read(fs.dev, fs.fsinfo_lba);
+    if (!buf) return -1;
+
+    struct fat32_fsinfo *info = (struct fat32_fsinfo *)buf->data;
+    info->free_count = fs.free_count + reserved_count;  // Reservations are not on disk
+    info->next_free = fs.next_free;
+    bcache_mark_dirty(buf);
+    bcache_release(buf);
+    fs.fsinfo_dirty = 0;
+    return 0;
+}
+
+int fat32_sync(void) {
+    if (!fs.dev) return -1;
+
+    // Allocations reach the FAT before the entries that point at them
+    int result = fat_flush();
+    if (fsinfo_update() != 0) result = -1;
+    if (bcache_sync(fs.dev) != 0) result = -1;
+    return result;
+}
+
+// Timer callback: write back whatever changed since the last sync
+static void fat32_writeback(void) {
+    if (fat_dirty_count || fs.fsinfo_dirty || bcache_dirty_count()) {
+        fat32_sync();
+    }
+}
+
+void fat32_set_writeback_interval(uint32_t ms) {
+    timer_set_interval(writeback_timer, ms);
+}
+
+// Called after every change. Write-back mounts leave it to the timer unless
+// the cache is filling up with dirty sectors.
+static int fat32_changed(void) {
+    if ((fs.flags & FAT32_MOUNT_WRITE_THROUGH) || bcache_under_pressure()) {
+        return fat32_sync();
+    }
+    return 0;
+}
+
+static uint32_t dentry_hash_of(uint32_t dir, const uint8_t *name) {
+    uint32_t h = 2166136261u ^ dir;
+    for (int i = 0; i < 11; i++) {
+        h = (h ^ name[i]) * 16777619u;
+    }
+    return h & (DIR_INDEX_BUCKETS - 1);
+}
+
+static struct dir_index *dir_index_find(uint32_t dir) {
+    for (int i = 0; i < DIR_INDEX_DIRS; i++) {
+        if (dir_indexes[i].dir == dir) return &dir_indexes[i];
+    }
+    return 0;
+}
+
+// Forget a directory's index and return its entries to the pool
+static void dir_index_drop(struct dir_index *di) {
+    struct dentry *d = di->entries;
+    while (d) {
+        struct dentry *next = d->dir_next;
+        struct dentry **link = &dentry_hash[dentry_hash_of(d->dir, d->name)];
+        while (*link != d) link = &(*link)->hash_next;
+        *link = d->hash_next;
+
+        d->hash_next = dentry_free;
+        dentry_free = d;
+        d = next;
+    }
+    di->dir = 0;
+    di->entries = 0;
+}
+
+static int dentry_insert(struct dir_index *di, const uint8_t *name, uint32_t lba, uint32_t index) {
+    if (!dentry_free) {
+        // Make room by dropping the least recently used other directory
+        struct dir_index *victim = 0;
+        for (int i = 0; i < DIR_INDEX_DIRS; i++) {
+            struct dir_index *c = &dir_indexes[i];
+            if (c->dir && c != di && (!victim || c->last_used < victim->last_used)) victim = c;
+        }
+        if (!victim) return -1;
+        dir_index_drop(victim);
+        if (!dentry_free) return -1;
+    }
+
+    struct dentry *d = dentry_free;
+    dentry_free = d->hash_next;
+
+    d->dir = di->dir;
+    memcpy(d->name, name, 11);
+    d->lba = lba;
+    d->index = index;
+
+    uint32_t h = dentry_hash_of(d->dir, name);
+    d->hash_next = dentry_hash[h];
+    dentry_hash[h] = d;
+    d->dir_next = di->entries;
+    di->entries = d;
+    return 0;
+}
+
+static void dentry_remove(struct dir_index *di, const uint8_t *name) {
+    struct dentry **link = &dentry_hash[dentry_hash_of(di->dir, name)];
+    while (*link) {
+        struct dentry *d = *link;
+        if (d->dir == di->dir && strncmp((char *)d->name, (char *)name, 11) == 0) {
+            *link = d->hash_next;
+
+            struct dentry **dl = &di->entries;
+            while (*dl != d) dl = &(*dl)->dir_next;
+            *dl = d->dir_next;
+
+            d->hash_next = dentry_free;
+            dentry_free = d;
+            return;
+        }
+        link = &d->hash_next;
+    }
+}
+
+// Index of a directory, reading the whole directory if it is not indexed
+// yet. Returns 0 if it cannot be indexed (the caller scans instead).
+static struct dir_index *dir_index_get(uint32_t dir) {
+    if (!dentry_hash) return 0;
+
+    struct dir_index *di = dir_index_find(dir);
+    if (di) {
+        di->last_used = ++dir_index_clock;
+        return di;
+    }
+
+    // Take a free slot, or the least recently used one
+    di = &dir_indexes[0];
+    for (int i = 0; i < DIR_INDEX_DIRS; i++) {
+        if (!dir_indexes[i].dir) {
+            di = &dir_indexes[i];
+            break;
+        }
+        if (dir_indexes[i].last_used < di->last_used) di = &dir_indexes[i];
+    }
+    if (di->dir) dir_index_drop(di);
+    di->dir = dir;
+    di->last_used = ++dir_index_clock;
+
+    uint32_t cluster = dir;
+    while (!is_end_of_chain(cluster)) {
+        uint32_t lba = cluster_to_lba(cluster);
+        for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+            struct bcache_buf *buf = bcache_read(fs.dev, lba + s);
+            if (!buf) {
+                dir_index_drop(di);
+                return 0;
+            }
+
+            struct fat32_dir_entry *entries = (struct fat32_dir_entry *)buf->data;
+            for (uint32_t i = 0; i < DIR_ENTRIES_PER_SECTOR; i++) {
+                struct fat32_dir_entry *entry = &entries[i];
+                if (entry->name[0] == 0x00) {  // End of directory
+                    bcache_release(buf);
+                    return di;
+                }
+                if (entry->name[0] == 0xE5) continue;
+                if ((entry->attr & FAT32_ATTR_LFN) == FAT32_ATTR_LFN) continue;
+                if (entry->attr & FAT32_ATTR_VOLUME_ID) continue;
+
+                if (dentry_insert(di, entry->name, lba + s, i) != 0) {
+                    // Larger than the whole pool
+                    bcache_release(buf);
+                    dir_index_drop(di);
+                    return 0;
+                }
+            }
+            bcache_release(buf);
+        }
+        cluster = get_next_cluster(cluster);
+    }
+
+    // A partial index would turn the unread entries into misses
+    if (cluster == FAT_READ_ERROR) {
+        dir_index_drop(di);
+        return 0;
+    }
+    return di;
+}
+
+// Find the entry called fat_name in dir. Returns 0 and its location, or -1.
+static int dir_lookup(uint32_t dir, const uint8_t *fat_name, uint32_t *lba, uint32_t *index) {
+    struct dir_index *di = dir_index_get(dir);
+    if (di) {
+        for (struct dentry *d = dentry_hash[dentry_hash_of(dir, fat_name)]; d; d = d->hash_next) {
+            if (d->dir == dir && strncmp((char *)d->name, (char *)fat_name, 11) == 0) {
+                *lba = d->lba;
+                *index = d->index;
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    // Not indexable: scan it
+    uint32_t cluster = dir;
+    while (!is_end_of_chain(cluster)) {
+        uint32_t dir_lba = cluster_to_lba(cluster);
+        for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+            struct bcache_buf *buf = bcache_read(fs.dev, dir_lba + s);
+            if (!buf) return -1;
+
+            struct fat32_dir_entry *entries = (struct fat32_dir_entry *)buf->data;
+            for (uint32_t i = 0; i < DIR_ENTRIES_PER_SECTOR; i++) {
+                struct fat32_dir_entry *entry = &entries[i];
+                if (entry->name[0] == 0x00) {  // End of directory
+                    bcache_release(buf);
+                    return -1;
+                }
+                if (entry->name[0] == 0xE5) continue;
+                if ((entry->attr & FAT32_ATTR_LFN) == FAT32_ATTR_LFN) continue;
+                if (entry->attr & FAT32_ATTR_VOLUME_ID) continue;
+
+                if (strncmp((char *)entry->name, (char *)fat_name, 11) == 0) {
+                    bcache_release(buf);
+                    *lba = dir_lba + s;
+                    *index = i;
+                    return 0;
+                }
+            }
+            bcache_release(buf);
+        }
+        cluster = get_next_cluster(cluster);
+    }
+    return -1;
+}
+
+// Zero a cluster in the cache; every sector is overwritten, so none is read first
+static int zero_cluster(uint32_t cluster) {
+    uint32_t lba = cluster_to_lba(cluster);
+    for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+        struct bcache_buf *buf = bcache_get(fs.dev, lba + s);
+        if (!buf) return -1;
+        memset(buf->data, 0, fs.bytes_per_sector);
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+    }
+    return 0;
+}
+
+// Put entry into the first free slot of dir, one sector at a time, and
+// report where it went. A full directory grows by one zeroed cluster.
+static int dir_add_entry(struct vfs_node *dir, const struct fat32_dir_entry *entry, uint32_t *lba, uint32_t *index) {
+    uint32_t cluster = dir->inode;
+    uint32_t last = 0;
+    while (!is_end_of_chain(cluster)) {
+        uint32_t dir_lba = cluster_to_lba(cluster);
+        for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+            struct bcache_buf *buf = bcache_read(fs.dev, dir_lba + s);
+            if (!buf) return -1;
+
+            struct fat32_dir_entry *entries = (struct fat32_dir_entry *)buf->data;
+            for (uint32_t i = 0; i < DIR_ENTRIES_PER_SECTOR; i++) {
+                if (entries[i].name[0] == 0x00 || entries[i].name[0] == 0xE5) { // unused or deleted slot
+                    memcpy(&entries[i], entry, sizeof(*entry));
+                    bcache_mark_dirty(buf);
+                    bcache_release(buf);
+                    *lba = dir_lba + s;
+                    *index = i;
+
+                    // Keep an existing index complete
+                    struct dir_index *di = dir_index_find(dir->inode);
+                    if (di && dentry_insert(di, entry->name, *lba, i) != 0) dir_index_drop(di);
+                    return 0;
+                }
+            }
+            bcache_release(buf);
+        }
+        last = cluster;
+        cluster = get_next_cluster(cluster);
+        if (cluster == FAT_READ_ERROR) return -1;
+    }
+    if (!last) return -1;
+
+    // The new cluster is zeroed and terminated before it is linked in
+    uint32_t got;
+    uint32_t added = alloc_clusters(last + 1, 1, &got);
+    if (added == 0) return -1;  // Volume full
+    if (zero_cluster(added) != 0 || set_fat_entry(added, 0x0FFFFFFF) != 0) {
+        release_cluster(added);
+        return -1;
+    }
+    if (set_fat_entry(last, added) != 0) {
+        set_fat_entry(added, 0);
+        release_cluster(added);
+        return -1;
+    }
+
+    struct bcache_buf *buf = bcache_read(fs.dev, cluster_to_lba(added));
+    if (!buf) return -1;
+    memcpy(buf->data, entry, sizeof(*entry));
+    bcache_mark_dirty(buf);
+    bcache_release(buf);
+    *lba = cluster_to_lba(added);
+    *index = 0;
+
+    struct dir_index *di = dir_index_find(dir->inode);
+    if (di && dentry_insert(di, entry->name, *lba, 0) != 0) dir_index_drop(di);
     return 0;
 }
 
 int fat32_mkdir(struct vfs_node *parent, const char *name){
-    uint32_t allocated_cluster = find_free_cluster(); // find free space to put the new directory
+    uint32_t got;
+    uint32_t allocated_cluster = alloc_clusters(0, 1, &got); // find free space to put the new directory
     if (allocated_cluster == 0) return -1; // disk full
-    set_fat_entry(allocated_cluster, 0x0FFFFFFF); // mark as end of chain
-    memset(cluster_buffer, 0, fs.bytes_per_cluster); // set the cluster buffer to all 0s to initialize
-    struct fat32_dir_entry *dot = (struct fat32_dir_entry *)cluster_buffer; // treat the start of the cluster buffer as a directory entry (.)
-    struct fat32_dir_entry *dotdot = (struct fat32_dir_entry *)(cluster_buffer + 32);
+    if (set_fat_entry(allocated_cluster, 0x0FFFFFFF) != 0) return -1; // mark as end of chain
+
+    if (zero_cluster(allocated_cluster) != 0) return -1;
+    struct bcache_buf *first = bcache_read(fs.dev, cluster_to_lba(allocated_cluster));
+    if (!first) return -1;
+
+    struct fat32_dir_entry *dot = (struct fat32_dir_entry *)first->data; // treat the start of the cluster as a directory entry (.)
+    struct fat32_dir_entry *dotdot = (struct fat32_dir_entry *)(first->data + 32);
 
     // adding . entry
     memcpy(dot->name, ".          ", 11);
@@ -116,35 +824,20 @@ int fat32_mkdir(struct vfs_node *parent, const char *name){
     dotdot->attr = 0x10;
     dotdot->first_cluster_low = parent->inode & 0xFFFF;
     dotdot->first_cluster_high = (parent->inode >> 16) & 0xFFFF;
+    bcache_release(first);
 
-    write_cluster(allocated_cluster, cluster_buffer);
-
-    read_cluster(parent->inode, cluster_buffer);
-    
-    int entries_per_cluster = fs.bytes_per_cluster / sizeof(struct fat32_dir_entry);
-
-    struct fat32_dir_entry *entries = (struct fat32_dir_entry *)cluster_buffer;
+    struct fat32_dir_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    string_to_fat32_name(name, entry.name);
+    entry.attr = FAT32_ATTR_DIRECTORY;
+    entry.first_cluster_low = allocated_cluster & 0xFFFF;
+    entry.first_cluster_high = (allocated_cluster >> 16) & 0xFFFF;
 
-    for (int i = 0; i < entries_per_cluster; i++){
-        if (entries[i].name[0] == 0x00){ // found an empty slot for the new directory
-            string_to_fat32_name(name, entries[i].name);
-            
-            entries[i].attr = 0x10;
-            entries[i].first_cluster_low = allocated_cluster & 0xFFFF;
-            entries[i].first_cluster_high = (allocated_cluster >> 16) & 0xFFFF;
-            entries[i].file_size = 0;
-
-            break;
-        }
-    }
-    write_cluster(parent->inode, cluster_buffer);
-    return 0;
+    uint32_t entry_lba, entry_index;
+    if (dir_add_entry(parent, &entry, &entry_lba, &entry_index) != 0) return -1; // volume full or I/O error
+    vfs_lookup_invalidate(parent);
 
-}
-
-// Check if cluster is end of chain
-static int is_end_of_chain(uint32_t cluster) {
-    return cluster >= 0x0FFFFFF8;
+    return fat32_changed();
 }
 
 // Convert 8.3 filename to normal string
@@ -202,88 +895,598 @@ static void string_to_fat32_name(const char *str, uint8_t *fat_name) {
 
 // Forward declarations
 static int fat32_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer);
+static int fat32_fread(struct vfs_file *f, uint32_t size, uint8_t *buffer);
+static int fat32_write(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *buffer);
+static int fat32_truncate(struct vfs_node *node, uint32_t size);
+static struct vfs_node *fat32_create(struct vfs_node *dir, const char *name);
 static struct dirent *fat32_readdir(struct vfs_node *node, uint32_t index);
 static struct vfs_node *fat32_finddir(struct vfs_node *node, const char *name);
+static int fat32_unlink(struct vfs_node *dir, const char *name);
+static int fat32_opendir(struct vfs_node *node, struct vfs_dir *dir);
+static struct dirent *fat32_nextdir(struct vfs_dir *dir);
+
+static uint32_t vnode_hash_of(uint32_t lba, uint32_t index) {
+    return (lba * DIR_ENTRIES_PER_SECTOR + index) & (VNODE_HASH_SIZE - 1);
+}
+
+static void vnode_lru_unlink(struct fat32_vnode *vn) {
+    if (vn->lru_prev) vn->lru_prev->lru_next = vn->lru_next;
+    else vnode_lru_head = vn->lru_next;
+    if (vn->lru_next) vn->lru_next->lru_prev = vn->lru_prev;
+    else vnode_lru_tail = vn->lru_prev;
+    vn->lru_prev = 0;
+    vn->lru_next = 0;
+}
+
+static void vnode_lru_push_front(struct fat32_vnode *vn) {
+    vn->lru_prev = 0;
+    vn->lru_next = vnode_lru_head;
+    if (vnode_lru_head) vnode_lru_head->lru_prev = vn;
+    vnode_lru_head = vn;
+    if (!vnode_lru_tail) vnode_lru_tail = vn;
+}
+
+static void vnode_unhash(struct fat32_vnode *vn) {
+    if (!vn->hashed) return;
+    struct fat32_vnode **link = &vnode_hash[vnode_hash_of(vn->file.dirent_lba, vn->file.dirent_index)];
+    while (*link) {
+        if (*link == vn) {
+            *link = vn->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    vn->hash_next = 0;
+    vn->hashed = 0;
+}
 
-// Allocate a node from cache
-static struct vfs_node *alloc_node(void) {
-    if (node_cache_used < NODE_CACHE_SIZE) {
-        return &node_cache[node_cache_used++];
+static struct fat32_vnode *vnode_lookup(uint32_t lba, uint32_t index) {
+    struct fat32_vnode *vn = vnode_hash[vnode_hash_of(lba, index)];
+    while (vn) {
+        if (vn->file.dirent_lba == lba && vn->file.dirent_index == index) return vn;
+        vn = vn->hash_next;
     }
-    return 0;  // Cache full
+    return 0;
 }
 
-// Create a VFS node from directory entry
-static struct vfs_node *create_node(struct fat32_dir_entry *entry) {
-    struct vfs_node *node = alloc_node();
-    if (!node) return 0;
+static void fat32_hold(struct vfs_node *node) {
+    ((struct fat32_vnode *)node)->refcount++;
+}
 
-    fat32_name_to_string(entry->name, node->name);
+static void fat32_release(struct vfs_node *node) {
+    struct fat32_vnode *vn = (struct fat32_vnode *)node;
+    if (vn->refcount > 0) vn->refcount--;
+    if (vn->refcount == 0) prealloc_trim(&vn->file);
+}
 
-    uint32_t cluster = (entry->first_cluster_high << 16) | entry->first_cluster_low;
+// Referenced node for the directory entry at index in sector lba, reusing
+// the cached one if there is one. Returns 0 when every node is in use.
+static struct vfs_node *get_node(struct fat32_dir_entry *entry, uint32_t lba, uint32_t index) {
+    if (!vnodes) return 0;
+
+    struct fat32_vnode *vn = vnode_lookup(lba, index);
+    if (!vn) {
+        // Recycle the least recently used node nobody holds
+        for (vn = vnode_lru_tail; vn && vn->refcount > 0; vn = vn->lru_prev);
+        if (!vn) return 0;
+        vnode_unhash(vn);
+        vfs_page_invalidate(&vn->node);
+
+        // A new generation tells cached lookups this is another file now
+        struct vfs_node *node = &vn->node;
+        uint32_t generation = node->generation;
+        memset(node, 0, sizeof(*node));
+        node->generation = generation + 1;
+        fat32_name_to_string(entry->name, node->name);
+        node->inode = (entry->first_cluster_high << 16) | entry->first_cluster_low;
+        node->size = entry->file_size;
+        node->release = fat32_release;
+        node->hold = fat32_hold;
+
+        struct fat32_file *file = &vn->file;
+        file->dirent_lba = lba;
+        file->dirent_index = index;
+        file->next_offset = 0;
+        file->window = 0;
+        file->ra_end = 0;
+        file->prealloc_count = 0;
+        file->map_valid = 0;
+
+        if (entry->attr & FAT32_ATTR_DIRECTORY) {
+            node->flags = VFS_DIRECTORY;
+            node->readdir = fat32_readdir;
+            node->finddir = fat32_finddir;
+            node->create = fat32_create;
+            node->unlink = fat32_unlink;
+            node->opendir = fat32_opendir;
+            node->nextdir = fat32_nextdir;
+        } else {
+            node->flags = VFS_FILE;
+            node->private_data = file;
+            node->read = fat32_read;
+            node->fread = fat32_fread;
+            node->write = fat32_write;
+            node->truncate = fat32_truncate;
+        }
 
-    node->inode = cluster;
-    node->size = entry->file_size;
-    node->private_data = 0;
+        uint32_t h = vnode_hash_of(lba, index);
+        vn->hash_next = vnode_hash[h];
+        vnode_hash[h] = vn;
+        vn->hashed = 1;
+    }
 
-    if (entry->attr & FAT32_ATTR_DIRECTORY) {
-        node->flags = VFS_DIRECTORY;
-        node->read = 0;
-        node->write = 0;
-        node->readdir = fat32_readdir;
-        node->finddir = fat32_finddir;
+    vn->refcount++;
+    vnode_lru_unlink(vn);
+    vnode_lru_push_front(vn);
+    return &vn->node;
+}
+
+// Add the chain's next cluster to the map. Once the extent array is full
+// only the count and tail keep up.
+static void extent_append(struct fat32_file *file, uint32_t cluster) {
+    struct fat32_extent *last = file->extent_count ? &file->extents[file->extent_count - 1] : 0;
+    int covered = !last || last->file_cluster + last->length == file->cluster_count;
+
+    if (covered) {
+        if (last && last->disk_cluster + last->length == cluster) {
+            last->length++;
+        } else if (file->extent_count < FAT32_FILE_EXTENTS) {
+            struct fat32_extent *e = &file->extents[file->extent_count++];
+            e->file_cluster = file->cluster_count;
+            e->disk_cluster = cluster;
+            e->length = 1;
+        }
+    }
+    file->cluster_count++;
+    file->tail_cluster = cluster;
+}
+
+static int extent_map_build(struct vfs_node *node, struct fat32_file *file) {
+    file->extent_count = 0;
+    file->cluster_count = 0;
+    file->tail_cluster = 0;
+
+    uint32_t cluster = node->inode;
+    while (cluster >= 2 && !is_end_of_chain(cluster) && file->cluster_count < fs.total_clusters) {
+        extent_append(file, cluster);
+        cluster = get_next_cluster(cluster);
+    }
+    if (cluster == FAT_READ_ERROR) return -1;  // Try again next time
+    file->map_valid = 1;
+    return 0;
+}
+
+// Disk cluster holding the file's n-th cluster (end of chain if past it,
+// FAT_READ_ERROR if the FAT could not be read)
+static uint32_t file_cluster(struct vfs_node *node, uint32_t n) {
+    struct fat32_file *file = (struct fat32_file *)node->private_data;
+    if (!file) {
+        uint32_t cluster = node->inode;
+        while (n-- && !is_end_of_chain(cluster)) cluster = get_next_cluster(cluster);
+        return cluster;
+    }
+
+    if (!file->map_valid && extent_map_build(node, file) != 0) return FAT_READ_ERROR;
+    if (n >= file->cluster_count) return 0x0FFFFFFF;
+
+    // Last extent starting at or before n
+    uint32_t lo = 0;
+    uint32_t hi = file->extent_count;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (file->extents[mid].file_cluster <= n) lo = mid;
+        else hi = mid;
+    }
+
+    struct fat32_extent *e = &file->extents[lo];
+    if (n < e->file_cluster + e->length) return e->disk_cluster + (n - e->file_cluster);
+
+    // Past the mapped runs: walk on from the end of the last one
+    uint32_t cluster = e->disk_cluster + e->length - 1;
+    for (uint32_t i = e->file_cluster + e->length - 1; i < n && !is_end_of_chain(cluster); i++) {
+        cluster = get_next_cluster(cluster);
+    }
+    return cluster;
+}
+
+// Start reading the file's bytes [from, to) into the buffer cache. cluster
+// holds the file offset cluster_pos, which is cluster aligned.
+static void fat32_prefetch(uint32_t cluster, uint32_t cluster_pos, uint32_t from, uint32_t to) {
+    blockdev_plug(fs.dev);
+    while (cluster_pos < to && cluster >= 2 && !is_end_of_chain(cluster)) {
+        uint32_t next_pos = cluster_pos + fs.bytes_per_cluster;
+        if (next_pos > from) {
+            uint32_t first = from > cluster_pos ? (from - cluster_pos) / fs.bytes_per_sector : 0;
+            uint32_t last = fs.sectors_per_cluster;
+            if (to < next_pos) {
+                last = (to - cluster_pos + fs.bytes_per_sector - 1) / fs.bytes_per_sector;
+            }
+            if (bcache_prefetch(fs.dev, cluster_to_lba(cluster) + first, last - first) != 0) break;
+        }
+        cluster_pos = next_pos;
+        cluster = get_next_cluster(cluster);
+    }
+    blockdev_unplug(fs.dev);
+}
+
+// Sequential detection: a read starting where the last one ended doubles
+// the read-ahead window, anything else halves it
+static void fat32_readahead_update(struct fat32_file *file, uint32_t offset, uint32_t size) {
+    if (offset == file->next_offset) {
+        file->window = file->window ? file->window * 2 : FAT32_RA_MIN_SECTORS;
+        if (file->window > FAT32_RA_MAX_SECTORS) file->window = FAT32_RA_MAX_SECTORS;
     } else {
-        node->flags = VFS_FILE;
-        node->read = fat32_read;
-        node->write = 0;  // Read-only for now
-        node->readdir = 0;
-        node->finddir = 0;
+        file->window /= 2;
+        file->ra_end = offset;
+    }
+    file->next_offset = offset + size;
+    if (file->ra_end < offset) file->ra_end = offset;
+}
+
+// Bytes from cluster_offset in cluster that one request can cover: whole
+// sectors, carried on through physically adjacent clusters
+static uint32_t direct_run(uint32_t cluster, uint32_t cluster_offset, uint32_t remaining) {
+    uint32_t max = FAT32_DIRECT_MAX_SECTORS * fs.bytes_per_sector;
+    uint32_t run = fs.bytes_per_cluster - cluster_offset;
+
+    while (run < remaining && run < max) {
+        uint32_t next = get_next_cluster(cluster);
+        if (next != cluster + 1) break;
+        cluster = next;
+        run += fs.bytes_per_cluster;
     }
 
-    return node;
+    if (run > remaining) run = remaining;
+    if (run > max) run = max;
+    return run - run % fs.bytes_per_sector;
 }
 
-// Read file contents
-static int fat32_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+// Read file contents. cursor, if given, is an open file's position: the
+// cluster it reached last time, the file offset that cluster starts at and
+// the chain generation both belong to. A read that continues there needs
+// no lookup at all.
+static int file_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer, uint32_t *cursor) {
     if (!node || !(node->flags & VFS_FILE)) return -1;
+    if (offset >= node->size) return 0;
+    if (size > node->size - offset) size = node->size - offset;
+
+    struct fat32_file *file = (struct fat32_file *)node->private_data;
+    uint32_t window = 0;
+    if (file) {
+        fat32_readahead_update(file, offset, size);
+        window = file->window * fs.bytes_per_sector;
+    }
 
-    uint32_t cluster = node->inode;
     uint32_t bytes_read = 0;
-    uint32_t file_pos = 0;
 
-    // Skip to offset cluster
-    while (file_pos + fs.bytes_per_cluster <= offset && !is_end_of_chain(cluster)) {
-        file_pos += fs.bytes_per_cluster;
-        cluster = get_next_cluster(cluster);
+    // Find the offset's cluster from the cursor or through the extent map
+    uint32_t file_pos = offset - offset % fs.bytes_per_cluster;
+    uint32_t cluster;
+    if (cursor && file && cursor[0] >= 2 && cursor[1] == file_pos && cursor[2] == file->chain_gen) {
+        cluster = cursor[0];
+    } else {
+        cluster = file_cluster(node, offset / fs.bytes_per_cluster);
     }
 
     // Read data
-    while (bytes_read < size && !is_end_of_chain(cluster)) {
-        read_cluster(cluster, cluster_buffer);
-
-        uint32_t cluster_offset = 0;
-        if (file_pos < offset) {
-            cluster_offset = offset - file_pos;
+    while (bytes_read < size && cluster >= 2 && !is_end_of_chain(cluster)) {
+        uint32_t cluster_offset = offset + bytes_read - file_pos;
+        uint32_t remaining = size - bytes_read;
+
+        // Large aligned stretches that read-ahead has not already brought
+        // in are read straight into the caller's buffer
+        uint32_t run = 0;
+        if (cluster_offset % fs.bytes_per_sector == 0 &&
+            ((uintptr_t)(buffer + bytes_read) & 3) == 0 &&
+            (!file || file->ra_end <= offset + bytes_read)) {
+            run = direct_run(cluster, cluster_offset, remaining);
+        }
+        if (run >= FAT32_DIRECT_MIN_SECTORS * fs.bytes_per_sector) {
+            uint32_t lba = cluster_to_lba(cluster) + cluster_offset / fs.bytes_per_sector;
+            uint32_t count = run / fs.bytes_per_sector;
+            if (blockdev_read(fs.dev, lba, count, buffer + bytes_read) != 0) {
+                return bytes_read ? (int)bytes_read : -1;
+            }
+            bcache_overlay(fs.dev, lba, count, buffer + bytes_read);  // Unwritten changes win
+            bytes_read += run;
+            if (file && file->ra_end < offset + bytes_read) file->ra_end = offset + bytes_read;
+
+            // The run only crossed physically adjacent clusters
+            uint32_t end = cluster_offset + run;
+            uint32_t crossed = end / fs.bytes_per_cluster;
+            if (crossed) {
+                file_pos += crossed * fs.bytes_per_cluster;
+                if (end % fs.bytes_per_cluster) cluster += crossed;
+                else cluster = get_next_cluster(cluster + crossed - 1);
+            }
+            continue;
         }
 
+        // The rest goes through the cache; an unaligned head only up to the
+        // sector boundary, so what follows can still be read directly
         uint32_t to_copy = fs.bytes_per_cluster - cluster_offset;
-        if (to_copy > size - bytes_read) {
-            to_copy = size - bytes_read;
+        if (to_copy > remaining) to_copy = remaining;
+        if (cluster_offset % fs.bytes_per_sector) {
+            uint32_t head = fs.bytes_per_sector - cluster_offset % fs.bytes_per_sector;
+            if (to_copy > head) to_copy = head;
         }
-        if (file_pos + cluster_offset + to_copy > node->size) {
-            to_copy = node->size - file_pos - cluster_offset;
+
+        // Request the missing part of this chunk as one batch, together
+        // with the read-ahead window, whenever less than half a window is
+        // still in flight ahead of the reader
+        uint32_t want = file_pos + cluster_offset + to_copy;
+        uint32_t ahead = file ? file->ra_end : 0;
+        if (ahead < want + window / 2) {
+            uint32_t from = ahead > file_pos + cluster_offset ? ahead : file_pos + cluster_offset;
+            uint32_t to = want + window;
+            if (to > node->size) to = node->size;
+            if (from < to) fat32_prefetch(cluster, file_pos, from, to);
+            if (file) file->ra_end = to;
         }
 
-        memcpy(buffer + bytes_read, cluster_buffer + cluster_offset, to_copy);
-        bytes_read += to_copy;
-        file_pos += fs.bytes_per_cluster;
+        // Copy out of the cached sectors
+        uint32_t lba = cluster_to_lba(cluster);
+        uint32_t pos = cluster_offset;
+        uint32_t end = cluster_offset + to_copy;
+        while (pos < end) {
+            uint32_t sector_offset = pos % fs.bytes_per_sector;
+            uint32_t chunk = fs.bytes_per_sector - sector_offset;
+            if (chunk > end - pos) chunk = end - pos;
+
+            struct bcache_buf *buf = bcache_read(fs.dev, lba + pos / fs.bytes_per_sector);
+            if (!buf) return bytes_read ? (int)bytes_read : -1;
+            memcpy(buffer + bytes_read, buf->data + sector_offset, chunk);
+            bcache_release(buf);
+
+            bytes_read += chunk;
+            pos += chunk;
+        }
 
-        cluster = get_next_cluster(cluster);
+        if (end == fs.bytes_per_cluster) {
+            file_pos += fs.bytes_per_cluster;
+            cluster = get_next_cluster(cluster);
+        }
     }
 
+    if (cluster == FAT_READ_ERROR && bytes_read == 0) return -1;
+    if (cursor && file) {
+        cursor[0] = cluster >= 2 && !is_end_of_chain(cluster) ? cluster : 0;
+        cursor[1] = file_pos;
+        cursor[2] = file->chain_gen;
+    }
     return bytes_read;
 }
 
+static int fat32_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+    return file_read(node, offset, size, buffer, 0);
+}
+
+// Read at an open file's offset, starting from its cursor
+static int fat32_fread(struct vfs_file *f, uint32_t size, uint8_t *buffer) {
+    int n = file_read(f->node, f->offset, size, buffer, f->pos);
+    if (n > 0) f->offset += n;
+    return n;
+}
+
+// Store a file's size and first cluster in its directory entry
+static int update_dirent(struct vfs_node *node) {
+    struct fat32_file *file = (struct fat32_file *)node->private_data;
+    if (!file || !file->dirent_lba) return -1;
+
+    struct bcache_buf *buf = bcache_read(fs.dev, file->dirent_lba);
+    if (!buf) return -1;
+
+    struct fat32_dir_entry *entry = (struct fat32_dir_entry *)buf->data + file->dirent_index;
+    entry->file_size = node->size;
+    entry->first_cluster_low = node->inode & 0xFFFF;
+    entry->first_cluster_high = (node->inode >> 16) & 0xFFFF;
+    entry->attr |= FAT32_ATTR_ARCHIVE;
+    bcache_mark_dirty(buf);
+    bcache_release(buf);
+    return 0;
+}
+
+// Make the file's chain at least clusters long. New clusters are looked
+// for right after the current tail so the file stays contiguous.
+static int grow_chain(struct vfs_node *node, uint32_t clusters) {
+    struct fat32_file *file = (struct fat32_file *)node->private_data;
+    if (!file->map_valid && extent_map_build(node, file) != 0) return -1;
+
+    uint32_t have = file->cluster_count;
+    uint32_t last = file->tail_cluster;
+
+    while (have < clusters) {
+        uint32_t need = clusters - have;
+        uint32_t first, got;
+
+        if (file->prealloc_count && last && file->prealloc_start == last + 1) {
+            // Use up the reservation behind the tail
+            first = file->prealloc_start;
+            got = need < file->prealloc_count ? need : file->prealloc_count;
+            file->prealloc_start += got;
+            file->prealloc_count -= got;
+            reserved_count -= got;
+        } else {
+            prealloc_trim(file);
+
+            uint32_t extra = have < FAT32_PREALLOC_MIN ? FAT32_PREALLOC_MIN : have;
+            if (extra > FAT32_PREALLOC_MAX) extra = FAT32_PREALLOC_MAX;
+            first = alloc_clusters(last ? last + 1 : 0, need + extra, &got);
+            if (first == 0) return -1;  // Volume full
+
+            // Keep what this write does not need as the file's reservation
+            if (got > need) {
+                file->prealloc_start = first + need;
+                file->prealloc_count = got - need;
+                reserved_count += got - need;
+                got = need;
+            }
+        }
+
+        // Link the run, then hang it off the old tail
+        for (uint32_t i = 0; i < got; i++) {
+            uint32_t next = i + 1 < got ? first + i + 1 : 0x0FFFFFFF;
+            if (set_fat_entry(first + i, next) != 0) return -1;
+        }
+        if (last) {
+            if (set_fat_entry(last, first) != 0) return -1;
+        } else {
+            node->inode = first;
+        }
+        for (uint32_t i = 0; i < got; i++) {
+            extent_append(file, first + i);
+        }
+        last = first + got - 1;
+        have += got;
+    }
+    return 0;
+}
+
+// Copy size bytes of data (zeros if data is 0) into the file at offset.
+// The chain must already cover the range. Sectors that are overwritten
+// whole, or lie past the old end of file, are not read first.
+static int write_range(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *data) {
+    uint32_t valid_end = node->size;
+
+    // Find the offset's cluster through the extent map
+    uint32_t file_pos = offset - offset % fs.bytes_per_cluster;
+    uint32_t cluster = file_cluster(node, offset / fs.bytes_per_cluster);
+
+    uint32_t done = 0;
+    while (done < size && cluster >= 2 && !is_end_of_chain(cluster)) {
+        uint32_t lba = cluster_to_lba(cluster);
+        uint32_t pos = offset + done - file_pos;
+
+        while (pos < fs.bytes_per_cluster && done < size) {
+            uint32_t sector = pos / fs.bytes_per_sector;
+            uint32_t sector_offset = pos % fs.bytes_per_sector;
+            uint32_t chunk = fs.bytes_per_sector - sector_offset;
+            if (chunk > size - done) chunk = size - done;
+
+            struct bcache_buf *buf;
+            if (chunk == fs.bytes_per_sector || file_pos + sector * fs.bytes_per_sector >= valid_end) {
+                buf = bcache_get(fs.dev, lba + sector);
+                if (buf && chunk != fs.bytes_per_sector) memset(buf->data, 0, fs.bytes_per_sector);
+            } else {
+                buf = bcache_read(fs.dev, lba + sector);
+            }
+            if (!buf) return done ? (int)done : -1;
+
+            if (data) memcpy(buf->data + sector_offset, data + done, chunk);
+            else memset(buf->data + sector_offset, 0, chunk);
+            bcache_mark_dirty(buf);
+            bcache_release(buf);
+
+            done += chunk;
+            pos += chunk;
+        }
+
+        file_pos += fs.bytes_per_cluster;
+        cluster = get_next_cluster(cluster);
+
+        // A long write must not wait for the timer to drain the cache
+        if (bcache_under_pressure()) fat32_sync();
+    }
+
+    if (cluster == FAT_READ_ERROR && done < size) return done ? (int)done : -1;
+    return done;
+}
+
+// Write size bytes at offset, growing the file as needed (data 0 writes zeros)
+static int file_write(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *data) {
+    if (size == 0) return 0;
+    if (offset + size < offset) return -1;  // Past the 4 GB FAT32 limit
+
+    uint32_t old_size = node->size;
+    uint32_t old_cluster = node->inode;
+    uint32_t end = offset + size;
+    if (grow_chain(node, (end + fs.bytes_per_cluster - 1) / fs.bytes_per_cluster) != 0) return -1;
+
+    // Writing past the end leaves a hole that reads back as zeros
+    if (offset > node->size) {
+        uint32_t gap = offset - node->size;
+        if (write_range(node, node->size, gap, 0) != (int)gap) return -1;
+    }
+
+    int written = write_range(node, offset, size, data);
+    if (written > 0 && offset + written > node->size) node->size = offset + written;
+
+    if (node->size != old_size || node->inode != old_cluster) {
+        if (update_dirent(node) != 0) return -1;
+    }
+    if (fat32_changed() != 0) return -1;
+    return written;
+}
+
+static int fat32_write(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *buffer) {
+    if (!node || !(node->flags & VFS_FILE) || !buffer) return -1;
+    return file_write(node, offset, size, buffer);
+}
+
+static int fat32_truncate(struct vfs_node *node, uint32_t size) {
+    if (!node || !(node->flags & VFS_FILE)) return -1;
+    if (size == node->size) return 0;
+
+    if (size > node->size) {
+        uint32_t grow = size - node->size;
+        return file_write(node, node->size, grow, 0) == (int)grow ? 0 : -1;
+    }
+
+    // Keep the clusters that still hold data and free the rest of the chain
+    struct fat32_file *file = (struct fat32_file *)node->private_data;
+    file->map_valid = 0;
+    file->chain_gen++;
+    prealloc_trim(file);
+    uint32_t keep = (size + fs.bytes_per_cluster - 1) / fs.bytes_per_cluster;
+    if (keep == 0) {
+        if (free_chain(node->inode) != 0) return -1;
+        node->inode = 0;
+    } else {
+        uint32_t cluster = node->inode;
+        for (uint32_t i = 1; i < keep && !is_end_of_chain(cluster); i++) {
+            cluster = get_next_cluster(cluster);
+        }
+        if (cluster == FAT_READ_ERROR) return -1;
+        if (!is_end_of_chain(cluster)) {
+            uint32_t rest = get_next_cluster(cluster);
+            if (rest == FAT_READ_ERROR) return -1;
+            if (!is_end_of_chain(rest)) {
+                if (set_fat_entry(cluster, 0x0FFFFFFF) != 0) return -1;
+                if (free_chain(rest) != 0) return -1;
+            }
+        }
+    }
+    node->size = size;
+
+    // Read-ahead must not run past the new end
+    if (file->ra_end > size) file->ra_end = size;
+
+    if (update_dirent(node) != 0) return -1;
+    return fat32_changed();
+}
+
+// Add an empty file to a directory; an existing file is returned as is
+static struct vfs_node *fat32_create(struct vfs_node *dir, const char *name) {
+    if (!dir || !(dir->flags & VFS_DIRECTORY) || !name || !name[0]) return 0;
+
+    struct vfs_node *existing = fat32_finddir(dir, name);
+    if (existing) {
+        if (existing->flags & VFS_FILE) return existing;
+        fat32_release(existing);
+        return 0;
+    }
+
+    struct fat32_dir_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    string_to_fat32_name(name, entry.name);
+    entry.attr = FAT32_ATTR_ARCHIVE;
+
+    uint32_t lba, index;
+    if (dir_add_entry(dir, &entry, &lba, &index) != 0) return 0;
+    if (fat32_changed() != 0) return 0;
+    return get_node(&entry, lba, index);
+}
+
 // Read directory entry by index
 static struct dirent *fat32_readdir(struct vfs_node *node, uint32_t index) {
     if (!node || !(node->flags & VFS_DIRECTORY)) return 0;
@@ -292,36 +1495,46 @@ static struct dirent *fat32_readdir(struct vfs_node *node, uint32_t index) {
     uint32_t entry_index = 0;
 
     while (!is_end_of_chain(cluster)) {
-        read_cluster(cluster, cluster_buffer);
+        uint32_t lba = cluster_to_lba(cluster);
+
+        for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+            struct bcache_buf *buf = bcache_read(fs.dev, lba + s);
+            if (!buf) return 0;
 
-        int entries_per_cluster = fs.bytes_per_cluster / sizeof(struct fat32_dir_entry);
-        struct fat32_dir_entry *entries = (struct fat32_dir_entry *)cluster_buffer;
+            struct fat32_dir_entry *entries = (struct fat32_dir_entry *)buf->data;
 
-        for (int i = 0; i < entries_per_cluster; i++) {
-            struct fat32_dir_entry *entry = &entries[i];
+            for (uint32_t i = 0; i < DIR_ENTRIES_PER_SECTOR; i++) {
+                struct fat32_dir_entry *entry = &entries[i];
 
-            // End of directory
-            if (entry->name[0] == 0x00) return 0;
+                // End of directory
+                if (entry->name[0] == 0x00) {
+                    bcache_release(buf);
+                    return 0;
+                }
 
-            // Skip deleted entries
-            if (entry->name[0] == 0xE5) continue;
+                // Skip deleted entries
+                if (entry->name[0] == 0xE5) continue;
 
-            // Skip LFN entries
-            if ((entry->attr & FAT32_ATTR_LFN) == FAT32_ATTR_LFN) continue;
+                // Skip LFN entries
+                if ((entry->attr & FAT32_ATTR_LFN) == FAT32_ATTR_LFN) continue;
 
-            // Skip volume label
-            if (entry->attr & FAT32_ATTR_VOLUME_ID) continue;
+                // Skip volume label
+                if (entry->attr & FAT32_ATTR_VOLUME_ID) continue;
 
-            // Skip . and ..
-            if (entry->name[0] == '.') continue;
+                // Skip . and ..
+                if (entry->name[0] == '.') continue;
 
-            if (entry_index == index) {
-                fat32_name_to_string(entry->name, dirent_buf.name);
-                dirent_buf.inode = (entry->first_cluster_high << 16) | entry->first_cluster_low;
-                return &dirent_buf;
+                if (entry_index == index) {
+                    fat32_name_to_string(entry->name, dirent_buf.name);
+                    dirent_buf.inode = (entry->first_cluster_high << 16) | entry->first_cluster_low;
+                    bcache_release(buf);
+                    return &dirent_buf;
+                }
+
+                entry_index++;
             }
 
-            entry_index++;
+            bcache_release(buf);
         }
 
         cluster = get_next_cluster(cluster);
@@ -330,6 +1543,57 @@ static struct dirent *fat32_readdir(struct vfs_node *node, uint32_t index) {
     return 0;
 }
 
+// Directory streams keep the current cluster in pos[0] and the next entry
+// within it in pos[1]
+static int fat32_opendir(struct vfs_node *node, struct vfs_dir *dir) {
+    dir->pos[0] = node->inode;
+    dir->pos[1] = 0;
+    return 0;
+}
+
+static struct dirent *fat32_nextdir(struct vfs_dir *dir) {
+    uint32_t entries_per_cluster = fs.sectors_per_cluster * DIR_ENTRIES_PER_SECTOR;
+
+    while (dir->pos[0] >= 2 && !is_end_of_chain(dir->pos[0])) {
+        uint32_t lba = cluster_to_lba(dir->pos[0]);
+
+        while (dir->pos[1] < entries_per_cluster) {
+            uint32_t s = dir->pos[1] / DIR_ENTRIES_PER_SECTOR;
+            struct bcache_buf *buf = bcache_read(fs.dev, lba + s);
+            if (!buf) return 0;
+
+            // Walk the rest of this sector without going back to the cache
+            struct fat32_dir_entry *entries = (struct fat32_dir_entry *)buf->data;
+            for (uint32_t i = dir->pos[1] % DIR_ENTRIES_PER_SECTOR; i < DIR_ENTRIES_PER_SECTOR; i++) {
+                struct fat32_dir_entry *entry = &entries[i];
+                dir->pos[1]++;
+
+                // End of directory
+                if (entry->name[0] == 0x00) {
+                    bcache_release(buf);
+                    dir->pos[0] = 0x0FFFFFFF;
+                    return 0;
+                }
+
+                if (entry->name[0] == 0xE5) continue;
+                if ((entry->attr & FAT32_ATTR_LFN) == FAT32_ATTR_LFN) continue;
+                if (entry->attr & FAT32_ATTR_VOLUME_ID) continue;
+                if (entry->name[0] == '.') continue;
+
+                fat32_name_to_string(entry->name, dir->entry.name);
+                dir->entry.inode = (entry->first_cluster_high << 16) | entry->first_cluster_low;
+                bcache_release(buf);
+                return &dir->entry;
+            }
+            bcache_release(buf);
+        }
+
+        dir->pos[0] = get_next_cluster(dir->pos[0]);
+        dir->pos[1] = 0;
+    }
+    return 0;
+}
+
 // Find file/directory by name
 static struct vfs_node *fat32_finddir(struct vfs_node *node, const char *name) {
     if (!node || !(node->flags & VFS_DIRECTORY)) return 0;
@@ -337,44 +1601,146 @@ static struct vfs_node *fat32_finddir(struct vfs_node *node, const char *name) {
     uint8_t fat_name[11];
     string_to_fat32_name(name, fat_name);
 
-    uint32_t cluster = node->inode;
+    uint32_t lba, index;
+    if (dir_lookup(node->inode, fat_name, &lba, &index) != 0) return 0;
 
-    while (!is_end_of_chain(cluster)) {
-        read_cluster(cluster, cluster_buffer);
-
-        int entries_per_cluster = fs.bytes_per_cluster / sizeof(struct fat32_dir_entry);
-        struct fat32_dir_entry *entries = (struct fat32_dir_entry *)cluster_buffer;
-
-        for (int i = 0; i < entries_per_cluster; i++) {
-            struct fat32_dir_entry *entry = &entries[i];
-
-            // End of directory
-            if (entry->name[0] == 0x00) return 0;
+    struct bcache_buf *buf = bcache_read(fs.dev, lba);
+    if (!buf) return 0;
+    struct vfs_node *found = get_node((struct fat32_dir_entry *)buf->data + index, lba, index);
+    bcache_release(buf);
+    return found;
+}
 
-            // Skip deleted entries
-            if (entry->name[0] == 0xE5) continue;
+// Checksum of an 8.3 name, stored in each of its long-name entries
+static uint8_t lfn_checksum(const uint8_t *name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+    }
+    return sum;
+}
 
-            // Skip LFN entries
-            if ((entry->attr & FAT32_ATTR_LFN) == FAT32_ATTR_LFN) continue;
+#define LFN_MAX_ENTRIES 20  // 255 characters, 13 per entry
 
-            // Skip volume label
-            if (entry->attr & FAT32_ATTR_VOLUME_ID) continue;
+// Mark deleted the long-name entries that belong to the short entry at
+// lba/index. They are taken only if they form one run, counting down to 1
+// right in front of it, whose checksum matches sum; anything else is
+// someone else's orphan and is left alone.
+static int dir_delete_lfn(uint32_t dir, uint32_t lba, uint32_t index, uint8_t sum) {
+    uint32_t run_lba[LFN_MAX_ENTRIES];
+    uint8_t run_index[LFN_MAX_ENTRIES];
+    uint8_t run_order[LFN_MAX_ENTRIES];
+    uint32_t run = 0;
 
-            // Check name match
-            if (strncmp((char *)entry->name, (char *)fat_name, 11) == 0) {
-                return create_node(entry);
+    uint32_t cluster = dir;
+    while (!is_end_of_chain(cluster)) {
+        uint32_t dir_lba = cluster_to_lba(cluster);
+        for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+            struct bcache_buf *buf = bcache_read(fs.dev, dir_lba + s);
+            if (!buf) return -1;
+
+            struct fat32_dir_entry *entries = (struct fat32_dir_entry *)buf->data;
+            for (uint32_t i = 0; i < DIR_ENTRIES_PER_SECTOR; i++) {
+                struct fat32_dir_entry *entry = &entries[i];
+                if (dir_lba + s == lba && i == index) {
+                    bcache_release(buf);
+                    goto found;
+                }
+                if (entry->name[0] == 0x00) {  // End of directory
+                    bcache_release(buf);
+                    return 0;
+                }
+
+                // The checksum sits where a short entry keeps creation_time_tenth
+                if ((entry->attr & FAT32_ATTR_LFN) != FAT32_ATTR_LFN || entry->name[0] == 0xE5 ||
+                    entry->creation_time_tenth != sum) {
+                    run = 0;
+                    continue;
+                }
+                if (entry->name[0] & 0x40) run = 0;  // Last part comes first
+                if (run == LFN_MAX_ENTRIES) continue;
+                run_lba[run] = dir_lba + s;
+                run_index[run] = (uint8_t)i;
+                run_order[run] = entry->name[0];
+                run++;
             }
+            bcache_release(buf);
         }
-
         cluster = get_next_cluster(cluster);
+        if (cluster == FAT_READ_ERROR) return -1;
     }
+    return 0;
 
+found:
+    if (run == 0 || !(run_order[0] & 0x40)) return 0;
+    for (uint32_t k = 0; k < run; k++) {
+        if ((run_order[k] & 0x1F) != run - k) return 0;
+    }
+    for (uint32_t k = 0; k < run; k++) {
+        struct bcache_buf *buf = bcache_read(fs.dev, run_lba[k]);
+        if (!buf) return -1;
+        ((struct fat32_dir_entry *)buf->data)[run_index[k]].name[0] = 0xE5;
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+    }
     return 0;
 }
 
-int fat32_init(uint32_t partition_lba) {
+// Remove a file from a directory and free its clusters. Its long name goes
+// first: a crash in between leaves the file under its short name rather
+// than an orphaned long name.
+static int fat32_unlink(struct vfs_node *dir, const char *name) {
+    if (!dir || !(dir->flags & VFS_DIRECTORY) || !name) return -1;
+
+    uint8_t fat_name[11];
+    string_to_fat32_name(name, fat_name);
+
+    uint32_t lba, index;
+    if (dir_lookup(dir->inode, fat_name, &lba, &index) != 0) return -1;
+
+    struct bcache_buf *buf = bcache_read(fs.dev, lba);
+    if (!buf) return -1;
+    struct fat32_dir_entry *entry = (struct fat32_dir_entry *)buf->data + index;
+    if (entry->attr & FAT32_ATTR_DIRECTORY) {
+        bcache_release(buf);
+        return -1;  // Only files
+    }
+
+    uint32_t cluster = (entry->first_cluster_high << 16) | entry->first_cluster_low;
+    bcache_release(buf);
+
+    if (dir_delete_lfn(dir->inode, lba, index, lfn_checksum(fat_name)) != 0) return -1;
+    buf = bcache_read(fs.dev, lba);
+    if (!buf) return -1;
+    ((struct fat32_dir_entry *)buf->data)[index].name[0] = 0xE5;
+    bcache_mark_dirty(buf);
+    bcache_release(buf);
+
+    struct dir_index *di = dir_index_find(dir->inode);
+    if (di) dentry_remove(di, fat_name);
+
+    // The slot may be reused; a holder keeps the node but it is no longer
+    // found, and can no longer update the freed entry
+    struct fat32_vnode *vn = vnode_lookup(lba, index);
+    if (vn) {
+        vnode_unhash(vn);
+        vn->file.dirent_lba = 0;
+        vn->file.map_valid = 0;
+        vn->file.chain_gen++;
+        prealloc_trim(&vn->file);
+        vn->node.inode = 0;
+        vn->node.size = 0;
+    }
+
+    if (cluster && free_chain(cluster) != 0) return -1;
+    return fat32_changed();
+}
+
+int fat32_init(struct blockdev *dev, uint32_t partition_lba, uint32_t flags) {
+    if (!dev || dev->sector_size != 512) return -1;
+
     // Read boot sector
-    ata_read_sectors(partition_lba, 1, sector_buffer);
+    if (blockdev_read(dev, partition_lba, 1, sector_buffer) != 0) return -1;
 
     struct fat32_bpb *bpb = (struct fat32_bpb *)sector_buffer;
 
@@ -382,18 +1748,90 @@ int fat32_init(uint32_t partition_lba) {
     if (bpb->fat_size_16 != 0 || bpb->fat_size_32 == 0) {
         return -1;  // Not FAT32
     }
+    if (bpb->bytes_per_sector != 512 || bpb->sectors_per_cluster == 0 ||
+        strncmp((char *)bpb->fs_type, "FAT32   ", 8) != 0) {
+        return -1;  // Boot code or another filesystem, not a FAT32 volume
+    }
 
     // Store filesystem info
+    fs.dev = dev;
+    fs.flags = flags;
     fs.bytes_per_sector = bpb->bytes_per_sector;
     fs.sectors_per_cluster = bpb->sectors_per_cluster;
     fs.bytes_per_cluster = fs.bytes_per_sector * fs.sectors_per_cluster;
     fs.fat_start_lba = partition_lba + bpb->reserved_sectors;
     fs.cluster_start_lba = fs.fat_start_lba + (bpb->num_fats * bpb->fat_size_32);
     fs.root_cluster = bpb->root_cluster;
+    fs.fat_size = bpb->fat_size_32;
+    fs.num_fats = bpb->num_fats;
+
+    // Bit 7 of ext_flags turns mirroring off; bits 3:0 then pick the live FAT
+    fs.fat_mirror = !(bpb->ext_flags & 0x80);
+    fs.active_fat = fs.fat_mirror ? 0 : (bpb->ext_flags & 0x0F);
+    if (fs.active_fat >= fs.num_fats) return -1;
+
+    fat_pages = kmalloc(sizeof(struct fat_page) * FAT32_FAT_CACHE_SECTORS);
+    uint8_t *fat_data = kmalloc(FAT32_FAT_CACHE_SECTORS * fs.bytes_per_sector);
+    fat_dirty_count = 0;
+    if (!fat_pages || !fat_data) return -1;
+    for (uint32_t i = 0; i < FAT32_FAT_CACHE_SECTORS; i++) {
+        fat_pages[i].data = fat_data + i * fs.bytes_per_sector;
+        fat_lru_push_front(&fat_pages[i]);
+    }
 
     int data_sectors = bpb->total_sectors_32 - (bpb->reserved_sectors + bpb->num_fats * bpb->fat_size_32);
     fs.total_clusters = data_sectors / bpb->sectors_per_cluster;
 
+    // A FAT can be shorter than the data area needs; never allocate past it
+    if (fs.total_clusters + 2 > fs.fat_size * (fs.bytes_per_sector / 4)) {
+        fs.total_clusters = fs.fat_size * (fs.bytes_per_sector / 4) - 2;
+    }
+
+    // FSInfo hints are only trusted when all three signatures match
+    // (reading it reuses sector_buffer, so bpb is dead from here on)
+    uint16_t fsinfo_sector = bpb->fs_info;
+    fs.fsinfo_lba = 0;
+    fs.free_count = FAT32_FSINFO_UNKNOWN;
+    fs.next_free = 2;
+    fs.fsinfo_dirty = 0;
+    cluster_bitmap_ready = 0;
+    if (fsinfo_sector != 0 && fsinfo_sector != 0xFFFF &&
+        blockdev_read(dev, partition_lba + fsinfo_sector, 1, sector_buffer) == 0) {
+        struct fat32_fsinfo *info = (struct fat32_fsinfo *)sector_buffer;
+        if (info->lead_sig == FAT32_FSINFO_LEAD_SIG &&
+            info->struct_sig == FAT32_FSINFO_STRUCT_SIG &&
+            info->trail_sig == FAT32_FSINFO_TRAIL_SIG) {
+            fs.fsinfo_lba = partition_lba + fsinfo_sector;
+            fs.free_count = info->free_count;
+            if (info->next_free != FAT32_FSINFO_UNKNOWN) fs.next_free = info->next_free;
+        }
+    }
+
+    // Vnode cache
+    if (!vnodes) {
+        vnodes = kmalloc(sizeof(struct fat32_vnode) * VNODE_CACHE_SIZE);
+        if (!vnodes) return -1;
+        for (int i = 0; i < VNODE_CACHE_SIZE; i++) {
+            vnode_lru_push_front(&vnodes[i]);
+        }
+    }
+
+    // Directory index pool, shared by every indexed directory
+    memset(dir_indexes, 0, sizeof(dir_indexes));
+    if (!dentry_hash) {
+        dentry_hash = kmalloc(sizeof(struct dentry *) * DIR_INDEX_BUCKETS);
+        struct dentry *pool = kmalloc(sizeof(struct dentry) * DIR_INDEX_ENTRIES);
+        if (!dentry_hash || !pool) return -1;
+        for (int i = 0; i < DIR_INDEX_ENTRIES; i++) {
+            pool[i].hash_next = dentry_free;
+            dentry_free = &pool[i];
+        }
+    }
+
+    if (writeback_timer < 0) {
+        writeback_timer = timer_register(fat32_writeback, FAT32_WRITEBACK_INTERVAL_MS);
+    }
+
     // Set up root node
     memset(&root_node, 0, sizeof(root_node));
     root_node.name[0] = '/';
@@ -402,6 +1840,10 @@ int fat32_init(uint32_t partition_lba) {
     root_node.inode = fs.root_cluster;
     root_node.readdir = fat32_readdir;
     root_node.finddir = fat32_finddir;
+    root_node.create = fat32_create;
+    root_node.unlink = fat32_unlink;
+    root_node.opendir = fat32_opendir;
+    root_node.nextdir = fat32_nextdir;
 
     return 0;
 }
@@ -409,3 +1851,93 @@ int fat32_init(uint32_t partition_lba) {
 struct vfs_node *fat32_get_root(void) {
     return &root_node;
 }
+
+int fat32_fragments(struct vfs_node *node) {
+    if (!node || (node != &root_node && node->release != fat32_release)) return -1;
+
+    int runs = 0;
+    uint32_t prev = 0;
+    uint32_t cluster = node->inode;
+    for (uint32_t n = 0; cluster >= 2 && !is_end_of_chain(cluster) && n < fs.total_clusters; n++) {
+        if (cluster != prev + 1) runs++;
+        prev = cluster;
+        cluster = get_next_cluster(cluster);
+    }
+    if (cluster == FAT_READ_ERROR) return -1;
+    return runs;
+}
+
+// Move a file's clusters into one free run. The copy and the new chain are
+// on disk before the directory entry points at them, and the old chain is
+// only freed after that, so a crash at any point leaves either the old or
+// the new file intact (plus, at worst, clusters nothing refers to).
+int fat32_defrag(struct vfs_node *node) {
+    if (!node || !(node->flags & VFS_FILE) || node->release != fat32_release) return -1;
+    struct fat32_file *file = (struct fat32_file *)node->private_data;
+    if (!file->dirent_lba) return -1;
+    int runs = fat32_fragments(node);
+    if (runs < 0) return -1;
+    if (runs <= 1) return 0;
+
+    prealloc_trim(file);
+    if (!file->map_valid && extent_map_build(node, file) != 0) return -1;
+    uint32_t count = file->cluster_count;
+
+    uint32_t got;
+    uint32_t first = alloc_clusters(0, count, &got);
+    if (got < count) {
+        // No free run is long enough
+        for (uint32_t i = 0; i < got; i++) release_cluster(first + i);
+        return -1;
+    }
+
+    // Copy the data and build the new chain while nothing points at it
+    uint32_t old_first = node->inode;
+    uint32_t cluster = old_first;
+    for (uint32_t n = 0; n < count; n++) {
+        uint32_t src = cluster_to_lba(cluster);
+        uint32_t dst = cluster_to_lba(first + n);
+        for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+            struct bcache_buf *from = bcache_read(fs.dev, src + s);
+            if (!from) goto fail;
+            struct bcache_buf *to = bcache_get(fs.dev, dst + s);
+            if (!to) {
+                bcache_release(from);
+                goto fail;
+            }
+            memcpy(to->data, from->data, BCACHE_SECTOR_SIZE);
+            bcache_mark_dirty(to);
+            bcache_release(to);
+            bcache_release(from);
+        }
+        if (set_fat_entry(first + n, n + 1 < count ? first + n + 1 : 0x0FFFFFFF) != 0) goto fail;
+        cluster = get_next_cluster(cluster);
+        if (cluster == FAT_READ_ERROR) goto fail;
+    }
+    if (fat32_sync() != 0) goto fail;
+
+    // Switch the directory entry over, then let go of the old chain
+    node->inode = first;
+    if (update_dirent(node) != 0 || fat32_sync() != 0) {
+        // The new entry may already be on disk. Free the new chain only once
+        // the old entry is back on disk; otherwise leak it, which is safe
+        node->inode = old_first;
+        if (update_dirent(node) == 0 && fat32_sync() == 0) goto fail;
+        return -1;
+    }
+    file->map_valid = 0;
+    file->chain_gen++;
+    file->next_offset = 0;
+    file->ra_end = 0;
+    if (free_chain(old_first) != 0) return -1;
+    fat32_changed();
+    return 1;
+
+fail:
+    // Nothing refers to the new clusters; give them all back
+    for (uint32_t i = 0; i < count; i++) {
+        set_fat_entry(first + i, 0);
+        release_cluster(first + i);
+    }
+    return -1;
+}
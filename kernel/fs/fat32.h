@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "vfs.h"
+#include "../drivers/blockdev.h"
 
 // FAT32 Boot Sector (BPB)
 struct fat32_bpb {
@@ -53,6 +54,22 @@ struct fat32_dir_entry {
     uint32_t file_size;
 } __attribute__((packed));
 
+// FSInfo sector (BPB fs_info): allocation hints kept by the driver
+struct fat32_fsinfo {
+    uint32_t lead_sig;            // FAT32_FSINFO_LEAD_SIG
+    uint8_t  reserved[480];
+    uint32_t struct_sig;          // FAT32_FSINFO_STRUCT_SIG
+    uint32_t free_count;          // Free clusters, 0xFFFFFFFF if unknown
+    uint32_t next_free;           // Where to start looking, 0xFFFFFFFF if unknown
+    uint8_t  reserved1[12];
+    uint32_t trail_sig;           // FAT32_FSINFO_TRAIL_SIG
+} __attribute__((packed));
+
+#define FAT32_FSINFO_LEAD_SIG   0x41615252
+#define FAT32_FSINFO_STRUCT_SIG 0x61417272
+#define FAT32_FSINFO_TRAIL_SIG  0xAA550000
+#define FAT32_FSINFO_UNKNOWN    0xFFFFFFFF
+
 // Directory entry attributes
 #define FAT32_ATTR_READ_ONLY 0x01
 #define FAT32_ATTR_HIDDEN    0x02
@@ -64,19 +81,59 @@ struct fat32_dir_entry {
 
 // FAT32 filesystem state
 struct fat32_fs {
-    uint32_t fat_start_lba;
+    struct blockdev *dev;
+    uint32_t fat_start_lba;       // First FAT copy
+    uint32_t fat_size;            // Sectors per FAT copy
+    uint32_t num_fats;
+    uint32_t active_fat;          // Copy that is read
+    int fat_mirror;               // Write changes to every copy
     uint32_t cluster_start_lba;
     uint32_t sectors_per_cluster;
     uint32_t root_cluster;
     uint32_t bytes_per_sector;
     uint32_t bytes_per_cluster;
     uint32_t total_clusters;
+    uint32_t fsinfo_lba;          // 0 if the volume has no valid FSInfo
+    uint32_t free_count;          // FAT32_FSINFO_UNKNOWN until counted
+    uint32_t next_free;           // Allocation hint
+    int fsinfo_dirty;
+    uint32_t flags;               // FAT32_MOUNT_*
 };
 
-// Initialize FAT32 filesystem
-int fat32_init(uint32_t partition_lba);
+// Mount flags
+#define FAT32_MOUNT_WRITE_THROUGH 0x01  // Sync after every change instead of deferring
+
+// FAT sectors kept in memory; the rest of the FAT is read as needed
+#ifndef FAT32_FAT_CACHE_SECTORS
+#define FAT32_FAT_CACHE_SECTORS 512  // 256 KB
+#endif
+
+// How often dirty FAT, FSInfo and directory sectors are written back
+#ifndef FAT32_WRITEBACK_INTERVAL_MS
+#define FAT32_WRITEBACK_INTERVAL_MS 5000
+#endif
+
+// Initialize FAT32 filesystem on a block device
+int fat32_init(struct blockdev *dev, uint32_t partition_lba, uint32_t flags);
 
 // Get root directory node
 struct vfs_node *fat32_get_root(void);
 
+// Write cached FAT and directory changes to disk. Returns 0 on success.
+int fat32_sync(void);
+
+// Number of separate runs a file's or directory's clusters are stored in
+// (1 = contiguous, 0 = no clusters, -1 = not a FAT32 node or the FAT
+// could not be read)
+int fat32_fragments(struct vfs_node *node);
+
+// Relocate a fragmented file into one contiguous run. Returns 1 if it was
+// moved, 0 if it already was contiguous, -1 if no free run is long enough
+// or the move failed (the file is unchanged then).
+int fat32_defrag(struct vfs_node *node);
+
+// Change the write-back interval; 0 leaves syncing to fat32_sync and
+// memory pressure
+void fat32_set_writeback_interval(uint32_t ms);
+
 #endif
@@ -1,7 +1,90 @@
 #include "vfs.h"
+#include "../heap.h"
+#include "../paging.h"
 
 static struct vfs_node *root_node = 0;
 
+// Lookup cache: (directory, name) -> node, with node 0 for a name that is
+// known not to exist. Direct-mapped, so a hit is one probe and no disk
+// access. Entries hold no references; they remember the generation of
+// the directory and node instead, and a node that has since been reused
+// for another file no longer matches.
+struct lookup_entry {
+    struct vfs_node *dir;   // 0 if the slot is unused
+    struct vfs_node *node;  // 0 for a negative entry
+    uint32_t dir_generation;
+    uint32_t node_generation;
+    char name[VFS_MAX_NAME];
+};
+static struct lookup_entry lookup_cache[VFS_LOOKUP_CACHE_SIZE];
+
+static struct vfs_file files[VFS_MAX_FILES];
+
+// Page cache: file data in VFS_PAGE_SIZE pages keyed by (node, page index),
+// hashed for lookup. Reclaim is CLOCK: the hand skips pages read since it
+// last passed, clearing their bit, and takes the first one that was not.
+struct vfs_page {
+    struct vfs_node *node;  // 0 if the page is free
+    uint32_t index;
+    uint32_t length;        // Valid bytes (less than a page at end of file)
+    int referenced;
+    uint32_t pinned;        // Mappings using the page; never reclaimed while set
+    struct vfs_page *hash_next;
+    uint8_t *data;
+};
+static struct vfs_page *pages = 0;
+static uint32_t page_count = 0;
+static struct vfs_page **page_hash = 0;
+static uint32_t page_hash_size = 0;  // Power of two
+static uint32_t clock_hand = 0;
+static uint8_t *page_data = 0;
+static uint8_t *zero_page = 0;  // Mapped in place of a page that could not be read
+
+// Mappings. Each has a slot of the mapping window to itself. Pages faulted
+// in are pinned; the ring remembers them in fault order, and once it is
+// full the oldest is unmapped again (to be faulted back in if touched), so
+// mappings never pin more than half the page cache.
+#define MAPPING_SLOT_SIZE (MMAP_SIZE / VFS_MAX_MAPPINGS)
+struct vfs_mapping {
+    struct vfs_node *node;  // 0 if the slot is free
+    uint32_t offset;
+    uint32_t size;
+    int error;              // A page could not be read; reported by vfs_munmap
+};
+static struct vfs_mapping mappings[VFS_MAX_MAPPINGS];
+static uint64_t *mapped_ring = 0;  // Virtual addresses, 0 for none
+static uint32_t mapped_ring_size = 0;
+static uint32_t mapped_ring_next = 0;
+
+// Simple string compare
+static int strcmp(const char *a, const char *b) {
+    while (*a && *b && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a - *b;
+}
+
+// Copy string
+static void strcpy(char *dest, const char *src) {
+    while (*src) {
+        *dest++ = *src++;
+    }
+    *dest = 0;
+}
+
+static int strlen(const char *s) {
+    int len = 0;
+    while (s[len]) len++;
+    return len;
+}
+
+static void memcpy(void *dest, const void *src, uint32_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    while (n--) *d++ = *s++;
+}
+
 struct vfs_node *vfs_root(void) {
     return root_node;
 }
@@ -10,8 +93,238 @@ void vfs_set_root(struct vfs_node *node) {
     root_node = node;
 }
 
+void vfs_release(struct vfs_node *node) {
+    if (node && node->release) {
+        node->release(node);
+    }
+}
+
+static void vfs_hold(struct vfs_node *node) {
+    if (node && node->hold) {
+        node->hold(node);
+    }
+}
+
+// Nodes that are refcounted but cannot be held again can not be cached
+static int lookup_cacheable(struct vfs_node *node) {
+    return !node || node->hold || !node->release;
+}
+
+static uint32_t lookup_hash(struct vfs_node *dir, const char *name) {
+    uint32_t hash = 2166136261u ^ (uint32_t)((uintptr_t)dir >> 4);
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash % VFS_LOOKUP_CACHE_SIZE;
+}
+
+static void lookup_drop(struct lookup_entry *e) {
+    e->dir = 0;
+    e->node = 0;
+}
+
+// Names may match case-insensitively, so drop everything under dir rather
+// than just the one name that changed
+void vfs_lookup_invalidate(struct vfs_node *dir) {
+    for (int i = 0; i < VFS_LOOKUP_CACHE_SIZE; i++) {
+        if (lookup_cache[i].dir == dir) lookup_drop(&lookup_cache[i]);
+    }
+}
+
+int vfs_page_cache_init(uint32_t count) {
+    if (count < 2) return -1;  // Mappings may pin half the pages; that must be one at least
+
+    page_hash_size = 1;
+    while (page_hash_size < count) page_hash_size <<= 1;
+
+    pages = kmalloc(sizeof(struct vfs_page) * count);
+    page_hash = kmalloc(sizeof(struct vfs_page *) * page_hash_size);
+    uint8_t *data = kmalloc_aligned(VFS_PAGE_SIZE * (count + 1), VFS_PAGE_SIZE);
+    mapped_ring_size = count / 2;
+    mapped_ring = kmalloc(sizeof(uint64_t) * mapped_ring_size);
+    if (!pages || !page_hash || !data || !mapped_ring) {
+        page_count = 0;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        pages[i].data = data + i * VFS_PAGE_SIZE;
+    }
+    page_data = data;
+    zero_page = data + count * VFS_PAGE_SIZE;
+    page_count = count;
+    return 0;
+}
+
+static uint32_t page_hash_of(struct vfs_node *node, uint32_t index) {
+    uint64_t key = ((uint64_t)(uintptr_t)node >> 4) * 31 + index;
+    key ^= key >> 17;
+    return (uint32_t)key & (page_hash_size - 1);
+}
+
+static struct vfs_page *page_lookup(struct vfs_node *node, uint32_t index) {
+    struct vfs_page *p = page_hash[page_hash_of(node, index)];
+    while (p) {
+        if (p->node == node && p->index == index) return p;
+        p = p->hash_next;
+    }
+    return 0;
+}
+
+static void page_drop(struct vfs_page *p) {
+    struct vfs_page **link = &page_hash[page_hash_of(p->node, p->index)];
+    while (*link) {
+        if (*link == p) {
+            *link = p->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    p->hash_next = 0;
+    p->node = 0;
+}
+
+// Free page for (node, index), reclaiming one if none is free
+static struct vfs_page *page_alloc(struct vfs_node *node, uint32_t index) {
+    struct vfs_page *p;
+    for (;;) {
+        p = &pages[clock_hand];
+        clock_hand = (clock_hand + 1) % page_count;
+        if (p->pinned) continue;
+        if (!p->node) break;
+        if (!p->referenced) {
+            page_drop(p);
+            break;
+        }
+        p->referenced = 0;
+    }
+
+    p->node = node;
+    p->index = index;
+    p->length = 0;
+    p->referenced = 1;
+    uint32_t h = page_hash_of(node, index);
+    p->hash_next = page_hash[h];
+    page_hash[h] = p;
+    return p;
+}
+
+// Unmap a faulted-in page and unpin its page
+static void mapped_page_drop(uint64_t virt) {
+    uint64_t phys = paging_unmap(virt);
+    if (!phys || phys == (uintptr_t)zero_page) return;
+    struct vfs_page *p = &pages[(phys - (uintptr_t)page_data) / VFS_PAGE_SIZE];
+    if (p->pinned) p->pinned--;
+}
+
+// Forget the cached pages first..last of a file. Mappings of them are torn
+// down first, so they fault the new contents back in rather than keep
+// showing the old ones.
+static void page_drop_range(struct vfs_node *node, uint32_t first, uint32_t last) {
+    for (uint32_t i = 0; i < mapped_ring_size; i++) {
+        uint64_t virt = mapped_ring[i];
+        if (!virt) continue;
+        uint64_t base = virt - (virt - MMAP_BASE) % MAPPING_SLOT_SIZE;
+        struct vfs_mapping *m = &mappings[(base - MMAP_BASE) / MAPPING_SLOT_SIZE];
+        uint32_t index = (m->offset + (uint32_t)(virt - base)) / VFS_PAGE_SIZE;
+        if (m->node == node && index >= first && index <= last) {
+            mapped_page_drop(virt);
+            mapped_ring[i] = 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < page_count; i++) {
+        if (pages[i].node == node && pages[i].index >= first && pages[i].index <= last) {
+            page_drop(&pages[i]);
+        }
+    }
+}
+
+void vfs_page_invalidate(struct vfs_node *node) {
+    if (node && page_count) page_drop_range(node, 0, 0xFFFFFFFF);
+}
+
+// Read from the filesystem, through the open file's cursor if there is one
+static int fs_read(struct vfs_node *node, struct vfs_file *f, uint32_t offset, uint32_t size, uint8_t *buffer) {
+    if (f && node->fread) {
+        f->offset = offset;
+        return node->fread(f, size, buffer);
+    }
+    return node->read(node, offset, size, buffer);
+}
+
+// Read page index of a file into the cache. Only a complete page (or the
+// file's whole tail, zero padded) is kept.
+static struct vfs_page *page_fill(struct vfs_node *node, struct vfs_file *f, uint32_t index) {
+    uint32_t start = index * VFS_PAGE_SIZE;
+    uint32_t expect = node->size - start < VFS_PAGE_SIZE ? node->size - start : VFS_PAGE_SIZE;
+
+    struct vfs_page *p = page_alloc(node, index);
+    int n = fs_read(node, f, start, VFS_PAGE_SIZE, p->data);
+    if (n < (int)expect) {
+        page_drop(p);
+        return 0;
+    }
+    p->length = expect;
+    for (uint32_t i = expect; i < VFS_PAGE_SIZE; i++) p->data[i] = 0;
+    return p;
+}
+
+// Read through the page cache. Missing pages that the request covers whole
+// are read in one go straight into the caller's buffer and copied into the
+// cache afterwards, so large reads keep their large disk requests.
+static int cached_read(struct vfs_node *node, struct vfs_file *f, uint32_t offset, uint32_t size, uint8_t *buffer) {
+    if (offset >= node->size) return 0;
+    if (size > node->size - offset) size = node->size - offset;
+
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t pos = offset + done;
+        uint32_t index = pos / VFS_PAGE_SIZE;
+        uint32_t in_page = pos % VFS_PAGE_SIZE;
+        struct vfs_page *p = page_lookup(node, index);
+
+        if (!p && in_page == 0 && size - done >= VFS_PAGE_SIZE) {
+            uint32_t run = 1;
+            while (run < page_count / 2 && size - done >= (run + 1) * VFS_PAGE_SIZE &&
+                   !page_lookup(node, index + run)) {
+                run++;
+            }
+
+            int n = fs_read(node, f, pos, run * VFS_PAGE_SIZE, buffer + done);
+            if (n <= 0) return done ? (int)done : n;
+            for (uint32_t i = 0; i < (uint32_t)n / VFS_PAGE_SIZE; i++) {
+                struct vfs_page *fill = page_alloc(node, index + i);
+                fill->length = VFS_PAGE_SIZE;
+                memcpy(fill->data, buffer + done + i * VFS_PAGE_SIZE, VFS_PAGE_SIZE);
+            }
+            done += n;
+            if ((uint32_t)n < run * VFS_PAGE_SIZE) break;  // Read error part way
+            continue;
+        }
+
+        if (!p) {
+            p = page_fill(node, f, index);
+            if (!p) return done ? (int)done : -1;
+        }
+
+        p->referenced = 1;
+        if (p->length <= in_page) break;
+        uint32_t chunk = p->length - in_page;
+        if (chunk > size - done) chunk = size - done;
+        memcpy(buffer + done, p->data + in_page, chunk);
+        done += chunk;
+        if (p->length < VFS_PAGE_SIZE) break;  // Last page of the file
+    }
+    return done;
+}
+
 int vfs_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
     if (node && node->read) {
+        if (page_count && (node->flags & VFS_FILE)) {
+            return cached_read(node, 0, offset, size, buffer);
+        }
         return node->read(node, offset, size, buffer);
     }
     return -1;
@@ -19,6 +332,11 @@ int vfs_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buf
 
 int vfs_write(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *buffer) {
     if (node && node->write) {
+        if (page_count && size) {
+            // The old last page is short; a write past it lengthens it too
+            page_drop_range(node, offset / VFS_PAGE_SIZE, (offset + size - 1) / VFS_PAGE_SIZE);
+            page_drop_range(node, node->size / VFS_PAGE_SIZE, node->size / VFS_PAGE_SIZE);
+        }
         return node->write(node, offset, size, buffer);
     }
     return -1;
@@ -32,27 +350,74 @@ struct dirent *vfs_readdir(struct vfs_node *node, uint32_t index) {
 }
 
 struct vfs_node *vfs_finddir(struct vfs_node *node, const char *name) {
-    if (node && (node->flags & VFS_DIRECTORY) && node->finddir) {
-        return node->finddir(node, name);
+    if (!node || !(node->flags & VFS_DIRECTORY) || !node->finddir || !name) return 0;
+
+    struct lookup_entry *e = &lookup_cache[lookup_hash(node, name)];
+    if (e->dir == node && e->dir_generation == node->generation && strcmp(e->name, name) == 0 &&
+        (!e->node || e->node->generation == e->node_generation)) {
+        vfs_hold(e->node);
+        return e->node;
     }
-    return 0;
+
+    struct vfs_node *found = node->finddir(node, name);
+    if (lookup_cacheable(found) && strlen(name) < VFS_MAX_NAME) {
+        e->dir = node;
+        e->node = found;
+        e->dir_generation = node->generation;
+        e->node_generation = found ? found->generation : 0;
+        strcpy(e->name, name);
+    }
+    return found;
 }
 
-// Simple string compare
-static int strcmp(const char *a, const char *b) {
-    while (*a && *b && *a == *b) {
-        a++;
-        b++;
+int vfs_opendir(struct vfs_node *node, struct vfs_dir *dir) {
+    if (!node || !dir || !(node->flags & VFS_DIRECTORY)) return -1;
+
+    dir->node = node;
+    dir->pos[0] = 0;
+    dir->pos[1] = 0;
+    if (node->opendir) {
+        return node->opendir(node, dir);
     }
-    return *a - *b;
+    return node->readdir ? 0 : -1;
 }
 
-// Copy string
-static void strcpy(char *dest, const char *src) {
-    while (*src) {
-        *dest++ = *src++;
+struct dirent *vfs_readdir_next(struct vfs_dir *dir) {
+    if (!dir || !dir->node) return 0;
+    if (dir->node->nextdir) {
+        return dir->node->nextdir(dir);
     }
-    *dest = 0;
+
+    // Fall back to reading by index; pos[0] is the next index
+    return vfs_readdir(dir->node, dir->pos[0]++);
+}
+
+void vfs_closedir(struct vfs_dir *dir) {
+    if (dir) dir->node = 0;
+}
+
+int vfs_truncate(struct vfs_node *node, uint32_t size) {
+    if (node && (node->flags & VFS_FILE) && node->truncate) {
+        vfs_page_invalidate(node);
+        return node->truncate(node, size);
+    }
+    return -1;
+}
+
+struct vfs_node *vfs_create(struct vfs_node *dir, const char *name) {
+    if (dir && (dir->flags & VFS_DIRECTORY) && dir->create) {
+        vfs_lookup_invalidate(dir);
+        return dir->create(dir, name);
+    }
+    return 0;
+}
+
+int vfs_unlink(struct vfs_node *dir, const char *name) {
+    if (dir && (dir->flags & VFS_DIRECTORY) && dir->unlink) {
+        vfs_lookup_invalidate(dir);
+        return dir->unlink(dir, name);
+    }
+    return -1;
 }
 
 struct vfs_node *vfs_resolve_path(const char *path) {
@@ -84,12 +449,154 @@ struct vfs_node *vfs_resolve_path(const char *path) {
         // Skip trailing slash
         if (*path == '/') path++;
 
-        // Find this component in current directory
+        // Find this component in current directory; only the node at the
+        // end of the path stays referenced
         if (component[0]) {
-            current = vfs_finddir(current, component);
-            if (!current) return 0;
+            struct vfs_node *next = vfs_finddir(current, component);
+            vfs_release(current);
+            if (!next) return 0;
+            current = next;
         }
     }
 
     return current;
 }
+
+int vfs_open(const char *path) {
+    for (int fd = 0; fd < VFS_MAX_FILES; fd++) {
+        if (files[fd].node) continue;
+
+        struct vfs_node *node = vfs_resolve_path(path);
+        if (!node) return -1;
+        if (!(node->flags & VFS_FILE)) {
+            vfs_release(node);
+            return -1;
+        }
+
+        files[fd].node = node;  // Keeps the reference until vfs_close
+        files[fd].offset = 0;
+        files[fd].pos[0] = 0;
+        files[fd].pos[1] = 0;
+        files[fd].pos[2] = 0;
+        return fd;
+    }
+    return -1;  // Table full
+}
+
+static struct vfs_file *vfs_file_get(int fd) {
+    if (fd < 0 || fd >= VFS_MAX_FILES || !files[fd].node) return 0;
+    return &files[fd];
+}
+
+int vfs_read_fd(int fd, uint8_t *buffer, uint32_t size) {
+    struct vfs_file *f = vfs_file_get(fd);
+    if (!f) return -1;
+
+    uint32_t offset = f->offset;
+    int n;
+    if (page_count) {
+        n = cached_read(f->node, f, offset, size, buffer);
+    } else if (f->node->fread) {
+        n = f->node->fread(f, size, buffer);
+    } else {
+        n = vfs_read(f->node, offset, size, buffer);
+    }
+    f->offset = offset + (n > 0 ? n : 0);
+    return n;
+}
+
+int vfs_seek(int fd, int32_t offset, int whence) {
+    struct vfs_file *f = vfs_file_get(fd);
+    if (!f) return -1;
+
+    int64_t base;
+    if (whence == VFS_SEEK_SET) base = 0;
+    else if (whence == VFS_SEEK_CUR) base = f->offset;
+    else if (whence == VFS_SEEK_END) base = f->node->size;
+    else return -1;
+
+    int64_t target = base + offset;
+    if (target < 0 || target > 0xFFFFFFFFll) return -1;
+    f->offset = (uint32_t)target;  // The cursor notices the jump itself
+    return (int)f->offset;
+}
+
+int vfs_close(int fd) {
+    struct vfs_file *f = vfs_file_get(fd);
+    if (!f) return -1;
+    vfs_release(f->node);
+    f->node = 0;
+    return 0;
+}
+
+void *vfs_mmap(struct vfs_node *node, uint32_t offset, uint32_t size) {
+    if (!page_count || !node || !(node->flags & VFS_FILE) || !node->read) return 0;
+    if (offset % VFS_PAGE_SIZE || size == 0 || size > MAPPING_SLOT_SIZE) return 0;
+
+    for (int i = 0; i < VFS_MAX_MAPPINGS; i++) {
+        if (mappings[i].node) continue;
+        vfs_hold(node);  // Kept until vfs_munmap
+        mappings[i].node = node;
+        mappings[i].offset = offset;
+        mappings[i].size = size;
+        mappings[i].error = 0;
+        return (void *)(uintptr_t)(MMAP_BASE + i * MAPPING_SLOT_SIZE);
+    }
+    return 0;
+}
+
+int vfs_munmap(void *addr) {
+    uint64_t base = (uint64_t)(uintptr_t)addr;
+    if (base < MMAP_BASE || base >= MMAP_BASE + MMAP_SIZE) return -1;
+    if ((base - MMAP_BASE) % MAPPING_SLOT_SIZE) return -1;
+    struct vfs_mapping *m = &mappings[(base - MMAP_BASE) / MAPPING_SLOT_SIZE];
+    if (!m->node) return -1;
+
+    // Every page still mapped is in the ring
+    for (uint32_t i = 0; i < mapped_ring_size; i++) {
+        if (mapped_ring[i] >= base && mapped_ring[i] < base + MAPPING_SLOT_SIZE) {
+            mapped_page_drop(mapped_ring[i]);
+            mapped_ring[i] = 0;
+        }
+    }
+
+    vfs_release(m->node);
+    m->node = 0;
+    return m->error ? -1 : 0;
+}
+
+int vfs_mmap_fault(uint64_t addr) {
+    if (!page_count || addr < MMAP_BASE || addr >= MMAP_BASE + MMAP_SIZE) return -1;
+
+    uint64_t base = addr - (addr - MMAP_BASE) % MAPPING_SLOT_SIZE;
+    struct vfs_mapping *m = &mappings[(base - MMAP_BASE) / MAPPING_SLOT_SIZE];
+    if (!m->node || addr - base >= m->size) return -1;
+
+    uint32_t pos = m->offset + (uint32_t)((addr - base) & ~(uint64_t)(VFS_PAGE_SIZE - 1));
+    if (pos >= m->node->size) return -1;  // Past the end of the file
+    uint32_t index = pos / VFS_PAGE_SIZE;
+
+    struct vfs_page *p = page_lookup(m->node, index);
+    if (!p) p = page_fill(m->node, 0, index);
+
+    // Make room in the ring first, then pin and map the page. A page that
+    // could not be read reads as zeroes, and the error waits for vfs_munmap.
+    uint64_t virt = addr & ~(uint64_t)(VFS_PAGE_SIZE - 1);
+    if (mapped_ring[mapped_ring_next]) mapped_page_drop(mapped_ring[mapped_ring_next]);
+    uint8_t *data = zero_page;
+    if (p) {
+        p->referenced = 1;
+        p->pinned++;
+        data = p->data;
+    } else {
+        m->error = 1;
+    }
+    if (paging_map(virt, (uintptr_t)data, 0) != 0) {
+        if (p) p->pinned--;  // Already mapped: a write to a read-only mapping
+        mapped_ring[mapped_ring_next] = 0;
+        return -1;
+    }
+    mapped_ring[mapped_ring_next] = virt;
+    mapped_ring_next = (mapped_ring_next + 1) % mapped_ring_size;
+    return 0;
+}
@@ -8,15 +8,52 @@
 #define VFS_MAX_PATH  256
 #define VFS_MAX_NAME  128
 
+// File data cache: 4 KB pages per node, shared by every reader
+#define VFS_PAGE_SIZE 4096
+#ifndef VFS_PAGE_CACHE_PAGES
+#define VFS_PAGE_CACHE_PAGES 512  // 2 MB
+#endif
+
+// File mappings: each one gets its own slot of the paging mapping window,
+// which bounds how large it can be
+#ifndef VFS_MAX_MAPPINGS
+#define VFS_MAX_MAPPINGS 16
+#endif
+
+// Open file descriptors
+#ifndef VFS_MAX_FILES
+#define VFS_MAX_FILES 32
+#endif
+
+// vfs_seek origins
+#define VFS_SEEK_SET 0
+#define VFS_SEEK_CUR 1
+#define VFS_SEEK_END 2
+
+// Slots in the name lookup cache
+#ifndef VFS_LOOKUP_CACHE_SIZE
+#define VFS_LOOKUP_CACHE_SIZE 64
+#endif
+
 // Forward declarations
 struct vfs_node;
 struct dirent;
+struct vfs_dir;
+struct vfs_file;
 
 // Function pointer types for filesystem operations
 typedef int (*read_fn)(struct vfs_node *, uint32_t offset, uint32_t size, uint8_t *buffer);
 typedef int (*write_fn)(struct vfs_node *, uint32_t offset, uint32_t size, const uint8_t *buffer);
 typedef struct dirent *(*readdir_fn)(struct vfs_node *, uint32_t index);
 typedef struct vfs_node *(*finddir_fn)(struct vfs_node *, const char *name);
+typedef int (*truncate_fn)(struct vfs_node *, uint32_t size);
+typedef struct vfs_node *(*create_fn)(struct vfs_node *, const char *name);
+typedef int (*unlink_fn)(struct vfs_node *, const char *name);
+typedef int (*opendir_fn)(struct vfs_node *, struct vfs_dir *dir);
+typedef struct dirent *(*nextdir_fn)(struct vfs_dir *dir);
+typedef void (*release_fn)(struct vfs_node *);
+typedef void (*hold_fn)(struct vfs_node *);
+typedef int (*fread_fn)(struct vfs_file *file, uint32_t size, uint8_t *buffer);
 
 // Filesystem node (file or directory)
 struct vfs_node {
@@ -24,12 +61,21 @@ struct vfs_node {
     uint32_t flags;       // VFS_FILE or VFS_DIRECTORY
     uint32_t size;
     uint32_t inode;       // Filesystem-specific identifier
+    uint32_t generation;  // Changed whenever the node is reused for another file
 
     // Operations
     read_fn read;
     write_fn write;
     readdir_fn readdir;
     finddir_fn finddir;
+    truncate_fn truncate;
+    create_fn create;     // Directories: add an empty file
+    unlink_fn unlink;     // Directories: remove a file
+    opendir_fn opendir;   // Directories: start a stream at the first entry
+    nextdir_fn nextdir;   // Directories: next entry of a stream
+    release_fn release;   // Drop a reference (0 for nodes that are never freed)
+    hold_fn hold;         // Take another reference (0 for nodes that are never freed)
+    fread_fn fread;       // Files: read at an open file's offset, using its cursor
 
     // Filesystem-specific data
     void *private_data;
@@ -41,16 +87,84 @@ struct dirent {
     uint32_t inode;
 };
 
+// Directory stream. The filesystem keeps its position in pos, so each
+// entry is read once no matter how long the directory is.
+struct vfs_dir {
+    struct vfs_node *node;
+    uint32_t pos[2];      // Filesystem-specific cursor
+    struct dirent entry;  // Last entry returned
+};
+
+// Open file. The filesystem keeps where the offset lies on disk in pos,
+// so sequential reads need not find it again.
+struct vfs_file {
+    struct vfs_node *node;  // 0 if the descriptor is free
+    uint32_t offset;
+    uint32_t pos[3];        // Filesystem-specific cursor
+};
+
 // VFS operations
 struct vfs_node *vfs_root(void);
+
+// Allocate the page cache. Without it, reads go straight to the filesystem.
+int vfs_page_cache_init(uint32_t pages);  // Needs at least 2 pages
+
+// Forget a node's cached pages. vfs_write and vfs_truncate do this
+// themselves; filesystems call it before reusing a node for another file.
+void vfs_page_invalidate(struct vfs_node *node);
+
 void vfs_set_root(struct vfs_node *node);
 
+// Nodes returned by vfs_finddir, vfs_create and vfs_resolve_path are
+// referenced; give them back with vfs_release when done
+void vfs_release(struct vfs_node *node);
+
 int vfs_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer);
 int vfs_write(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *buffer);
 struct dirent *vfs_readdir(struct vfs_node *node, uint32_t index);
 struct vfs_node *vfs_finddir(struct vfs_node *node, const char *name);
 
+// vfs_finddir remembers what it found, and names it did not find. Changes
+// through vfs_create and vfs_unlink drop a directory's entries themselves;
+// a filesystem that adds or removes names any other way must call this.
+void vfs_lookup_invalidate(struct vfs_node *dir);
+
+// Iterate a directory: open a stream, read entries until 0, close it.
+// Filesystems without streams are read by index.
+int vfs_opendir(struct vfs_node *node, struct vfs_dir *dir);
+struct dirent *vfs_readdir_next(struct vfs_dir *dir);
+void vfs_closedir(struct vfs_dir *dir);
+
+// Set a file's size, freeing or zero-filling the difference
+int vfs_truncate(struct vfs_node *node, uint32_t size);
+
+// Create an empty file in a directory (or return the file if it exists)
+struct vfs_node *vfs_create(struct vfs_node *dir, const char *name);
+
+// Remove a file from a directory
+int vfs_unlink(struct vfs_node *dir, const char *name);
+
 // Path resolution
 struct vfs_node *vfs_resolve_path(const char *path);
 
+// File descriptors: open a file by path, read from and move its offset,
+// close it. Return -1 on error.
+int vfs_open(const char *path);
+int vfs_read_fd(int fd, uint8_t *buffer, uint32_t size);
+int vfs_seek(int fd, int32_t offset, int whence);
+int vfs_close(int fd);
+
+// Map size bytes of a file from offset (a multiple of VFS_PAGE_SIZE)
+// into memory. Nothing is read until a page is touched; the page fault then
+// maps the page cache's copy in place, so callers must not write through
+// the mapping. Returns the address, or
+// 0 if there is no page cache, no free slot, or the range does not fit.
+// A page that cannot be read is mapped as zeroes; vfs_munmap then returns -1,
+// so check it before trusting what was read through the mapping.
+void *vfs_mmap(struct vfs_node *node, uint32_t offset, uint32_t size);
+int vfs_munmap(void *addr);
+
+// Page fault handler for mapped files: 0 if addr was mapped in
+int vfs_mmap_fault(uint64_t addr);
+
 #endif
@@ -0,0 +1,25 @@
+#include "heap.h"
+
+static uint64_t heap_next = KHEAP_START;
+
+void *kmalloc_aligned(uint32_t size, uint32_t align) {
+    if (align == 0) align = 8;
+
+    uint64_t addr = (heap_next + align - 1) & ~((uint64_t)align - 1);
+    if (addr + size > KHEAP_END) return 0;
+    heap_next = addr + size;
+
+    uint8_t *p = (uint8_t *)(uintptr_t)addr;
+    for (uint32_t i = 0; i < size; i++) {
+        p[i] = 0;
+    }
+    return p;
+}
+
+void *kmalloc(uint32_t size) {
+    return kmalloc_aligned(size, 8);
+}
+
+uint32_t kheap_free(void) {
+    return (uint32_t)(KHEAP_END - heap_next);
+}
@@ -0,0 +1,20 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdint.h>
+
+// Kernel heap: a bump allocator over physical memory above the kernel image
+// and the application load window. Memory is identity mapped (see paging.c),
+// so returned pointers double as physical addresses for DMA. Nothing is ever
+// freed; drivers and caches allocate their working set once at init.
+#define KHEAP_START 0x00400000  // 4 MB
+#define KHEAP_END   0x02000000  // 32 MB
+
+// Allocate zeroed memory. Returns 0 when the heap is exhausted.
+void *kmalloc(uint32_t size);
+void *kmalloc_aligned(uint32_t size, uint32_t align);
+
+// Bytes still available
+uint32_t kheap_free(void);
+
+#endif
@@ -40,6 +40,20 @@ extern void isr30(void);
 extern void isr31(void);
 extern void irq0(void);
 extern void irq1(void);
+extern void irq2(void);
+extern void irq3(void);
+extern void irq4(void);
+extern void irq5(void);
+extern void irq6(void);
+extern void irq7(void);
+extern void irq8(void);
+extern void irq9(void);
+extern void irq10(void);
+extern void irq11(void);
+extern void irq12(void);
+extern void irq13(void);
+extern void irq14(void);
+extern void irq15(void);
 
 void idt_set_gate(int n, uint64_t handler) {
     idt[n].offset_low = handler & 0xFFFF;
@@ -69,9 +83,18 @@ static void pic_remap(void) {
     __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0x01), "Nd"((uint16_t)0x21));
     __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0x01), "Nd"((uint16_t)0xA1));
 
-    // Mask all interrupts except IRQ1 (keyboard)
-    __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0xFD), "Nd"((uint16_t)0x21));
-    __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0xFF), "Nd"((uint16_t)0xA1));
+    // Mask all interrupts except IRQ1 (keyboard), IRQ2 (cascade) and IRQ14/15 (IDE)
+    __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0xF9), "Nd"((uint16_t)0x21));
+    __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0x3F), "Nd"((uint16_t)0xA1));
+}
+
+// Unmask a single IRQ line on the PIC
+void pic_unmask(int irq) {
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    uint8_t mask;
+    __asm__ volatile ("inb %1, %0" : "=a"(mask) : "Nd"(port));
+    mask &= ~(1 << (irq & 7));
+    __asm__ volatile ("outb %0, %1" : : "a"(mask), "Nd"(port));
 }
 
 void idt_init(void) {
@@ -115,6 +138,20 @@ void idt_init(void) {
     // Set up IRQ handlers (32+)
     idt_set_gate(32, (uint64_t)irq0);  // Timer
     idt_set_gate(33, (uint64_t)irq1);  // Keyboard
+    idt_set_gate(34, (uint64_t)irq2);
+    idt_set_gate(35, (uint64_t)irq3);
+    idt_set_gate(36, (uint64_t)irq4);
+    idt_set_gate(37, (uint64_t)irq5);
+    idt_set_gate(38, (uint64_t)irq6);
+    idt_set_gate(39, (uint64_t)irq7);
+    idt_set_gate(40, (uint64_t)irq8);
+    idt_set_gate(41, (uint64_t)irq9);
+    idt_set_gate(42, (uint64_t)irq10);
+    idt_set_gate(43, (uint64_t)irq11);
+    idt_set_gate(44, (uint64_t)irq12);
+    idt_set_gate(45, (uint64_t)irq13);
+    idt_set_gate(46, (uint64_t)irq14); // Primary IDE
+    idt_set_gate(47, (uint64_t)irq15); // Secondary IDE
 
     // Load IDT
     idtp.limit = sizeof(idt) - 1;
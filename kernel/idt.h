@@ -21,5 +21,6 @@ struct idt_ptr {
 
 void idt_init(void);
 void idt_set_gate(int n, uint64_t handler);
+void pic_unmask(int irq);
 
 #endif
@@ -5,7 +5,8 @@ global isr0, isr1, isr2, isr3, isr4, isr5, isr6, isr7
 global isr8, isr9, isr10, isr11, isr12, isr13, isr14, isr15
 global isr16, isr17, isr18, isr19, isr20, isr21, isr22, isr23
 global isr24, isr25, isr26, isr27, isr28, isr29, isr30, isr31
-global irq0, irq1
+global irq0, irq1, irq2, irq3, irq4, irq5, irq6, irq7
+global irq8, irq9, irq10, irq11, irq12, irq13, irq14, irq15
 
 ; Import C handler
 extern isr_handler
@@ -71,6 +72,20 @@ ISR_NOERR 31
 ; Hardware IRQs
 IRQ 0, 32    ; Timer
 IRQ 1, 33    ; Keyboard
+IRQ 2, 34    ; Cascade
+IRQ 3, 35
+IRQ 4, 36
+IRQ 5, 37
+IRQ 6, 38
+IRQ 7, 39
+IRQ 8, 40
+IRQ 9, 41
+IRQ 10, 42
+IRQ 11, 43
+IRQ 12, 44
+IRQ 13, 45
+IRQ 14, 46   ; Primary IDE
+IRQ 15, 47   ; Secondary IDE
 
 ; Common ISR handler
 isr_common:
@@ -51,7 +51,19 @@ static const char *exception_names[] = {
     "Reserved", "Reserved"
 };
 
+static page_fault_fn page_fault_handler = 0;
+
+void page_fault_install_handler(page_fault_fn handler) {
+    page_fault_handler = handler;
+}
+
 void isr_handler(uint64_t int_no) {
+    if (int_no == 14 && page_fault_handler) {
+        uint64_t addr;
+        __asm__ volatile ("mov %%cr2, %0" : "=r"(addr));
+        if (page_fault_handler(addr) == 0) return;
+    }
+
     print_at("EXCEPTION: ", 0, 10, 0x0C);
     if (int_no < 32) {
         print_at(exception_names[int_no], 11, 10, 0x0C);
@@ -65,12 +77,32 @@ void isr_handler(uint64_t int_no) {
     }
 }
 
+// Device handlers for IRQ lines (0-15)
+static irq_fn irq_handlers[16][IRQ_MAX_SHARED];
+
+int irq_install_handler(int irq, irq_fn handler) {
+    if (irq < 0 || irq >= 16) return -1;
+    for (int i = 0; i < IRQ_MAX_SHARED; i++) {
+        if (irq_handlers[irq][i] == handler) return 0;
+        if (!irq_handlers[irq][i]) {
+            irq_handlers[irq][i] = handler;
+            return 0;
+        }
+    }
+    return -1;  // Line is full
+}
+
 void irq_handler(uint64_t int_no) {
     if (int_no == 33) {
         // Keyboard interrupt - read scancode and pass to keyboard driver
         uint8_t scancode;
         __asm__ volatile ("inb %1, %0" : "=a"(scancode) : "Nd"((uint16_t)0x60));
         keyboard_handle_scancode(scancode);
+    } else if (int_no >= 32 && int_no < 48) {
+        int irq = int_no - 32;
+        for (int i = 0; i < IRQ_MAX_SHARED && irq_handlers[irq][i]; i++) {
+            irq_handlers[irq][i](irq);
+        }
     }
 
     // Send End of Interrupt (EOI) to PIC
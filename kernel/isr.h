@@ -6,4 +6,17 @@
 void isr_handler(uint64_t int_no);
 void irq_handler(uint64_t int_no);
 
+// Register a handler for a hardware IRQ line (0-15). Handlers run with
+// interrupts disabled, before the EOI is sent. A line can be shared by up
+// to IRQ_MAX_SHARED handlers; each must check whether its device fired.
+#define IRQ_MAX_SHARED 4
+typedef void (*irq_fn)(int irq);
+int irq_install_handler(int irq, irq_fn handler);
+
+// Page faults are offered to this handler with the faulting address first.
+// Returning 0 means it mapped the page and the access is retried; anything
+// else ends in the usual exception halt.
+typedef int (*page_fault_fn)(uint64_t addr);
+void page_fault_install_handler(page_fault_fn handler);
+
 #endif
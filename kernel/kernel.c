@@ -1,11 +1,25 @@
 // VANTA Kernel
 
 #include "idt.h"
+#include "paging.h"
+#include "isr.h"
 #include "drivers/ata.h"
+#include "drivers/ahci.h"
+#include "drivers/blockdev.h"
+#include "drivers/nvme.h"
+#include "drivers/virtio_blk.h"
 #include "drivers/keyboard.h"
+#include "drivers/timer.h"
+#include "fs/bcache.h"
 #include "fs/fat32.h"
 #include "fs/vfs.h"
 
+// Build with -DMOUNT_FLAGS=FAT32_MOUNT_WRITE_THROUGH to write every
+// filesystem change to disk immediately
+#ifndef MOUNT_FLAGS
+#define MOUNT_FLAGS 0
+#endif
+
 // Video memory starts at 0xB8000
 // Each character: 2 bytes (char + color)
 // Color: 0x0F = white on black
@@ -29,15 +43,38 @@ void print_color(const char *str, int row, unsigned char color) {
 void kernel_main(void) {
     print("VANTA OS - 64-bit C Kernel", 0);
 
+    // Map device memory and the kernel heap
+    paging_init();
+
     // Initialize keyboard and interrupts
     keyboard_init();
     idt_init();
+    timer_init();
 
-    // Initialize ATA and mount filesystem
+    // Bring up disk controllers; NVMe, paravirtual and AHCI disks register
+    // first so they are preferred over the legacy IDE ones when looking for
+    // a volume
+    nvme_init();
+    virtio_blk_init();
+    ahci_init();
     ata_init();
-    ata_select_drive(ATA_DRIVE_SLAVE);
 
-    if (fat32_init(0) == 0) {
+    // Sector cache between the filesystem and the disks
+    bcache_init(BCACHE_DEFAULT_BUFFERS);
+
+    // File data cache above the filesystems, which also backs vfs_mmap
+    vfs_page_cache_init(VFS_PAGE_CACHE_PAGES);
+    page_fault_install_handler(vfs_mmap_fault);
+
+    // Mount the first disk that carries a FAT32 volume
+    int mounted = 0;
+    for (int i = 0; i < blockdev_count() && !mounted; i++) {
+        if (fat32_init(blockdev_get(i), 0, MOUNT_FLAGS) == 0) {
+            mounted = 1;
+        }
+    }
+
+    if (mounted) {
         print_color("FAT32 mounted", 1, 0x0A);
         vfs_set_root(fat32_get_root());
     } else {
@@ -50,6 +87,9 @@ void kernel_main(void) {
     extern int shell_main(void);
     shell_main();
 
+    // Nothing deferred may be lost on the way down
+    if (mounted) fat32_sync();
+
     // If shell exits, halt
     print("Shell exited. System halted.", 5);
     while (1) {
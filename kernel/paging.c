@@ -0,0 +1,61 @@
+#include "paging.h"
+#include "heap.h"
+
+// One PML4, one PDPT and four page directories cover 0-4 GB with 2 MB pages
+static uint64_t pml4[512] __attribute__((aligned(PAGE_SIZE)));
+static uint64_t pdpt[512] __attribute__((aligned(PAGE_SIZE)));
+static uint64_t page_dirs[4][512] __attribute__((aligned(PAGE_SIZE)));
+
+// The mapping window's page directory; its page tables come from the heap
+static uint64_t mmap_dir[512] __attribute__((aligned(PAGE_SIZE)));
+
+void paging_init(void) {
+    for (int gb = 0; gb < 4; gb++) {
+        // Device registers live in the last gigabyte; never cache them
+        uint64_t flags = PAGE_PRESENT | PAGE_WRITE | PAGE_HUGE;
+        if (gb == 3) flags |= PAGE_PCD | PAGE_PWT;
+
+        for (int i = 0; i < 512; i++) {
+            uint64_t phys = ((uint64_t)gb << 30) | ((uint64_t)i * HUGE_PAGE_SIZE);
+            page_dirs[gb][i] = phys | flags;
+        }
+        pdpt[gb] = (uint64_t)(uintptr_t)page_dirs[gb] | PAGE_PRESENT | PAGE_WRITE;
+    }
+    pdpt[MMAP_BASE >> 30] = (uint64_t)(uintptr_t)mmap_dir | PAGE_PRESENT | PAGE_WRITE;
+    pml4[0] = (uint64_t)(uintptr_t)pdpt | PAGE_PRESENT | PAGE_WRITE;
+
+    __asm__ volatile ("mov %0, %%cr3" : : "r"((uint64_t)(uintptr_t)pml4) : "memory");
+}
+
+// Page table entry for virt, allocating its table if create is set
+static uint64_t *mmap_pte(uint64_t virt, int create) {
+    if (virt < MMAP_BASE || virt >= MMAP_BASE + MMAP_SIZE) return 0;
+
+    uint64_t *dir_entry = &mmap_dir[(virt - MMAP_BASE) >> 21];
+    if (!(*dir_entry & PAGE_PRESENT)) {
+        if (!create) return 0;
+        uint64_t *table = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+        if (!table) return 0;
+        *dir_entry = (uint64_t)(uintptr_t)table | PAGE_PRESENT | PAGE_WRITE;
+    }
+
+    uint64_t *table = (uint64_t *)(uintptr_t)(*dir_entry & ~0xFFFULL);
+    return &table[(virt >> 12) & 511];
+}
+
+int paging_map(uint64_t virt, uint64_t phys, uint64_t flags) {
+    uint64_t *pte = mmap_pte(virt, 1);
+    if (!pte || (*pte & PAGE_PRESENT)) return -1;
+    *pte = (phys & ~0xFFFULL) | flags | PAGE_PRESENT;
+    return 0;
+}
+
+uint64_t paging_unmap(uint64_t virt) {
+    uint64_t *pte = mmap_pte(virt, 0);
+    if (!pte || !(*pte & PAGE_PRESENT)) return 0;
+
+    uint64_t phys = *pte & ~0xFFFULL;
+    *pte = 0;
+    __asm__ volatile ("invlpg (%0)" : : "r"((uintptr_t)virt) : "memory");
+    return phys;
+}
@@ -0,0 +1,33 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+
+#define PAGE_SIZE      4096
+#define HUGE_PAGE_SIZE 0x200000
+
+// Page table entry bits
+#define PAGE_PRESENT 0x001
+#define PAGE_WRITE   0x002
+#define PAGE_PWT     0x008  // Write-through
+#define PAGE_PCD     0x010  // Cache disable
+#define PAGE_HUGE    0x080  // 2 MB page (in a page directory)
+
+// Mapping window: 4 KB pages right above the identity map, set up one at a
+// time by paging_map. Page tables are allocated as they are needed.
+#define MMAP_BASE 0x100000000ULL  // 4 GB
+#define MMAP_SIZE 0x40000000ULL   // 1 GB
+
+// Replace the bootloader's single 2 MB mapping with an identity map of the
+// low 4 GB in 2 MB pages. The top gigabyte (PCI MMIO hole) is mapped uncached.
+void paging_init(void);
+
+// Map the page at virt (inside the mapping window) to phys. Returns -1 if
+// virt is outside the window, already mapped, or no page table is left.
+int paging_map(uint64_t virt, uint64_t phys, uint64_t flags);
+
+// Remove the page at virt. Returns the physical address it was mapped to,
+// or 0 if it was not mapped.
+uint64_t paging_unmap(uint64_t virt);
+
+#endif
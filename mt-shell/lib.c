@@ -3,6 +3,7 @@
 
 #include "../kernel/drivers/keyboard.h"
 #include "../kernel/fs/vfs.h"
+#include "../kernel/heap.h"
 
 // ============================================================================
 // Memory Allocator (bump allocator with static buffer)
@@ -10,10 +11,12 @@
 
 #define HEAP_SIZE 131072  // 128KB heap for shell
 
-static char heap[HEAP_SIZE];
+static char *heap;  // Taken from the kernel heap; .bss lives in low memory
 static int heap_offset = 0;
 
 char* malloc(int size) {
+    if (!heap) heap = kmalloc(HEAP_SIZE);
+    if (!heap) return (char*)0;
     int aligned_size = (size + 7) & ~7;
     if (heap_offset + aligned_size > HEAP_SIZE) {
         return (char*)0;
@@ -527,7 +530,9 @@ int set_cwd(const char* path) {
     if (!node) {
         return -1;  // Path not found
     }
-    if (!(node->flags & VFS_DIRECTORY)) {
+    int is_dir = node->flags & VFS_DIRECTORY;
+    vfs_release(node);
+    if (!is_dir) {
         return -2;  // Not a directory
     }
 
@@ -540,6 +545,7 @@ int file_exists(const char* path) {
     char full[VFS_MAX_PATH];
     build_full_path(path, full);
     struct vfs_node* node = vfs_resolve_path(full);
+    vfs_release(node);
     return node != (void*)0;
 }
 
@@ -548,12 +554,15 @@ char* read_file(const char* path) {
     build_full_path(path, full);
     struct vfs_node* node = vfs_resolve_path(full);
     if (!node) return "";
-    if (!(node->flags & VFS_FILE)) return "";
 
-    char* buffer = malloc(node->size + 1);
-    if (!buffer) return "";
+    char* buffer = (node->flags & VFS_FILE) ? malloc(node->size + 1) : (char*)0;
+    if (!buffer) {
+        vfs_release(node);
+        return "";
+    }
 
     int bytes_read = vfs_read(node, 0, node->size, (uint8_t*)buffer);
+    vfs_release(node);
     if (bytes_read < 0) {
         buffer[0] = '\0';
         return buffer;
@@ -563,14 +572,130 @@ char* read_file(const char* path) {
     return buffer;
 }
 
+// Replace a file's contents, creating the file if needed
 int write_file(const char* path, const char* content) {
     char full[VFS_MAX_PATH];
     build_full_path(path, full);
     struct vfs_node* node = vfs_resolve_path(full);
-    if (!node) return -1;
+    if (!node) {
+        // Split off the last component and create it in its parent
+        int slash = strlen(full) - 1;
+        while (slash > 0 && full[slash] != '/') slash--;
+        if (full[slash + 1] == '\0') return -1;
+
+        char parent[VFS_MAX_PATH];
+        strncpy(parent, full, slash > 0 ? slash : 1);
+        parent[slash > 0 ? slash : 1] = '\0';
+        struct vfs_node* dir = vfs_resolve_path(parent);
+        node = vfs_create(dir, full + slash + 1);
+        vfs_release(dir);
+        if (!node) return -1;
+    }
 
+    // Overwrite in place, then drop whatever the old contents had past the end
     int len = strlen(content);
-    return vfs_write(node, 0, len, (const uint8_t*)content);
+    int written = vfs_write(node, 0, len, (const uint8_t*)content);
+    if (written == len && vfs_truncate(node, len) != 0) written = -1;
+    vfs_release(node);
+    return written == len ? written : -1;
+}
+
+// Write every cached filesystem change to disk now
+extern int fat32_sync(void);
+
+int fs_sync(void) {
+    return fat32_sync();
+}
+
+// ============================================================================
+// Defragmentation
+// ============================================================================
+
+extern int fat32_fragments(struct vfs_node* node);
+extern int fat32_defrag(struct vfs_node* node);
+
+#define DEFRAG_REPORT_SIZE 4096
+#define DEFRAG_MAX_DEPTH 16
+
+static char defrag_report[DEFRAG_REPORT_SIZE];
+static int defrag_len;
+static int defrag_files, defrag_fragmented, defrag_fragments, defrag_moved, defrag_failed;
+
+static void defrag_append(const char* line) {
+    int len = strlen(line);
+    if (defrag_len + len >= DEFRAG_REPORT_SIZE) return;
+    strcpy(defrag_report + defrag_len, line);
+    defrag_len += len;
+}
+
+// Report (and with fix set, relocate) every fragmented file below path.
+// skip is a subtree left out because it was done already.
+static void defrag_walk(const char* path, struct vfs_node* dir, const char* skip, int fix, int depth) {
+    struct vfs_dir stream;
+    struct dirent* entry;
+    if (vfs_opendir(dir, &stream) != 0) return;
+
+    while ((entry = vfs_readdir_next(&stream)) != (void*)0) {
+        char child[VFS_MAX_PATH];
+        if (strlen(path) + strlen(entry->name) + 2 > VFS_MAX_PATH) continue;
+        strcpy(child, path);
+        if (child[1] != '\0') strcat(child, "/");
+        strcat(child, entry->name);
+        if (skip && strcmp(child, skip) == 0) continue;
+
+        struct vfs_node* node = vfs_finddir(dir, entry->name);
+        if (!node) continue;
+
+        if (node->flags & VFS_DIRECTORY) {
+            if (depth < DEFRAG_MAX_DEPTH) defrag_walk(child, node, skip, fix, depth + 1);
+        } else {
+            int runs = fat32_fragments(node);
+            defrag_files++;
+            if (runs > 1) {
+                char line[VFS_MAX_PATH + 48];
+                defrag_fragmented++;
+                defrag_fragments += runs;
+                if (!fix) {
+                    sprintf(line, "%s: %d fragments\n", child, runs);
+                } else if (fat32_defrag(node) > 0) {
+                    defrag_moved++;
+                    sprintf(line, "%s: %d fragments -> 1\n", child, runs);
+                } else {
+                    defrag_failed++;
+                    sprintf(line, "%s: %d fragments, no room to move\n", child, runs);
+                }
+                // Keep room for the summary
+                if (defrag_len < DEFRAG_REPORT_SIZE - 256) defrag_append(line);
+            }
+        }
+        vfs_release(node);
+    }
+    vfs_closedir(&stream);
+}
+
+// Report fragmentation per file and for the whole volume; with fix set,
+// make each fragmented file contiguous. /apps goes first: the ELF loader
+// reads those files in full on every exec, so they get the free runs.
+char* fs_defrag(int fix) {
+    defrag_len = 0;
+    defrag_report[0] = '\0';
+    defrag_files = defrag_fragmented = defrag_fragments = defrag_moved = defrag_failed = 0;
+
+    struct vfs_node* apps = vfs_resolve_path("/apps");
+    int have_apps = apps && (apps->flags & VFS_DIRECTORY);
+    if (have_apps) defrag_walk("/apps", apps, (void*)0, fix, 1);
+    vfs_release(apps);
+    defrag_walk("/", vfs_root(), have_apps ? "/apps" : (void*)0, fix, 0);
+
+    char line[128];
+    sprintf(line, "%d files, %d fragmented (%d fragments)", defrag_files, defrag_fragmented, defrag_fragments);
+    defrag_append(line);
+    if (fix) {
+        sprintf(line, ", %d moved, %d left", defrag_moved, defrag_failed);
+        defrag_append(line);
+    }
+    defrag_append("\n");
+    return defrag_report;
 }
 
 // List directory - returns array of names
@@ -587,26 +712,56 @@ static int dir_entry_count = 0;
 int list_dir_count(const char* path) {
     struct vfs_node* node = vfs_resolve_path(path);
     if (!node) return 0;
-    if (!(node->flags & VFS_DIRECTORY)) return 0;
 
     dir_entry_count = 0;
-    uint32_t index = 0;
-    struct dirent* entry;
-
-    while ((entry = vfs_readdir(node, index)) != (void*)0) {
-        dir_entry_count++;
-        index++;
+    struct vfs_dir dir;
+    if (vfs_opendir(node, &dir) == 0) {
+        while (vfs_readdir_next(&dir) != (void*)0) {
+            dir_entry_count++;
+        }
+        vfs_closedir(&dir);
     }
+    vfs_release(node);
 
     return dir_entry_count;
 }
 
+// Callers walk index 0, 1, 2, ...; keep the stream open between calls so
+// that costs one pass over the directory instead of one per entry
+static struct vfs_dir entry_dir;
+static char entry_path[VFS_MAX_PATH];
+static int entry_next = 0;
+
+// The open stream holds a reference to its directory until it is closed
+static void entry_dir_close(void) {
+    struct vfs_node* node = entry_dir.node;
+    vfs_closedir(&entry_dir);
+    vfs_release(node);
+}
+
 char* list_dir_entry(const char* path, int index) {
-    struct vfs_node* node = vfs_resolve_path(path);
-    if (!node) return "";
+    if (!entry_dir.node || index < entry_next || strcmp(path, entry_path) != 0) {
+        entry_dir_close();
+        struct vfs_node* node = vfs_resolve_path(path);
+        if (!node) return "";
+        if (vfs_opendir(node, &entry_dir) != 0) {
+            vfs_release(node);
+            return "";
+        }
+        strncpy(entry_path, path, VFS_MAX_PATH - 1);
+        entry_path[VFS_MAX_PATH - 1] = '\0';
+        entry_next = 0;
+    }
 
-    struct dirent* entry = vfs_readdir(node, index);
-    if (!entry) return "";
+    struct dirent* entry = (void*)0;
+    while (entry_next <= index) {
+        entry = vfs_readdir_next(&entry_dir);
+        if (!entry) {
+            entry_dir_close();
+            return "";
+        }
+        entry_next++;
+    }
 
     return entry->name;
 }
@@ -616,34 +771,42 @@ char* list_dir_entry(const char* path, int index) {
 char* list_dir(const char* path) {
     struct vfs_node* node = vfs_resolve_path(path);
     if (!node) return "";
-    if (!(node->flags & VFS_DIRECTORY)) return "";
 
     // First pass: calculate size
     int total_size = 0;
-    uint32_t index = 0;
+    struct vfs_dir dir;
     struct dirent* entry;
 
-    while ((entry = vfs_readdir(node, index)) != (void*)0) {
+    if (vfs_opendir(node, &dir) != 0) {
+        vfs_release(node);
+        return "";
+    }
+    while ((entry = vfs_readdir_next(&dir)) != (void*)0) {
         total_size += strlen(entry->name) + 1;  // +1 for newline
-        index++;
     }
+    vfs_closedir(&dir);
 
-    if (total_size == 0) return "";
-
-    char* result = malloc(total_size + 1);
-    if (!result) return "";
+    char* result = total_size ? malloc(total_size + 1) : (char*)0;
+    if (!result) {
+        vfs_release(node);
+        return "";
+    }
 
     result[0] = '\0';
-    index = 0;
     char* pos = result;
 
-    while ((entry = vfs_readdir(node, index)) != (void*)0) {
-        int len = strlen(entry->name);
-        strcpy(pos, entry->name);
-        pos += len;
-        *pos++ = '\n';
-        index++;
+    // Second pass: the sectors are cached now; stop if the directory grew
+    if (vfs_opendir(node, &dir) == 0) {
+        while ((entry = vfs_readdir_next(&dir)) != (void*)0) {
+            int len = strlen(entry->name);
+            if (pos - result + len + 1 > total_size) break;
+            strcpy(pos, entry->name);
+            pos += len;
+            *pos++ = '\n';
+        }
+        vfs_closedir(&dir);
     }
+    vfs_release(node);
     *pos = '\0';
 
     return result;
@@ -711,11 +874,13 @@ int exec_program(const char* path, char** args) {
         return -1;
     }
     if (!(node->flags & VFS_FILE)) {
+        vfs_release(node);
         mt_print("exec: not a file\n");
         return -2;
     }
 
     int rc = elf_execute(node, args);
+    vfs_release(node);
     if (rc < 0) {
         mt_print("exec failed with code ");
         print_int(rc);